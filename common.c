@@ -2,46 +2,185 @@
 #include <config.h>
 #endif
 #include <gst/gst.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/inotify.h>
 
 
 #include "common.h"
 #include "gstdvbsink-marshal.h"
 
-void queue_push(queue_entry_t **queue_base, GstBuffer *buffer, size_t start, size_t end)
-{
-	queue_entry_t *entry = g_malloc(sizeof(queue_entry_t));
-	queue_entry_t *last = *queue_base;
-#if GST_VERSION_MAJOR < 1
-	gst_buffer_ref(buffer);
-	entry->buffer = buffer;
-#else
-	entry->buffer = gst_buffer_copy(buffer);
+#ifndef IOV_MAX
+#define IOV_MAX 1024
 #endif
-	entry->start = start;
-	entry->end = end;
-	if (!last)
+
+gboolean mapped_buffer_alloc(mapped_buffer_t *mapped, gsize size)
+{
+	mapped_buffer_release(mapped);
+	mapped->buffer = gst_buffer_new_and_alloc(size);
+	if (!mapped->buffer) return FALSE;
+	if (!gst_buffer_map(mapped->buffer, &mapped->map, GST_MAP_READ | GST_MAP_WRITE))
 	{
-		*queue_base = entry;
+		gst_buffer_unref(mapped->buffer);
+		mapped->buffer = NULL;
+		return FALSE;
 	}
-	else
+	return TRUE;
+}
+
+void mapped_buffer_set(mapped_buffer_t *mapped, GstBuffer *buffer)
+{
+	if (mapped->buffer == buffer) return;
+	mapped_buffer_release(mapped);
+	if (!buffer) return;
+	if (!gst_buffer_map(buffer, &mapped->map, GST_MAP_READ)) return;
+	mapped->buffer = gst_buffer_ref(buffer);
+}
+
+void mapped_buffer_release(mapped_buffer_t *mapped)
+{
+	if (!mapped->buffer) return;
+	gst_buffer_unmap(mapped->buffer, &mapped->map);
+	gst_buffer_unref(mapped->buffer);
+	mapped->buffer = NULL;
+}
+
+gboolean buffer_equal(GstBuffer *a, GstBuffer *b)
+{
+	GstMapInfo map;
+	gboolean ret;
+	if (a == b) return TRUE;
+	if (!a || !b) return FALSE;
+	if (gst_buffer_get_size(a) != gst_buffer_get_size(b)) return FALSE;
+	if (!gst_buffer_map(b, &map, GST_MAP_READ)) return FALSE;
+	ret = !gst_buffer_memcmp(a, 0, map.data, map.size);
+	gst_buffer_unmap(b, &map);
+	return ret;
+}
+
+gboolean propose_page_allocation(GstQuery *query, guint size, guint min_buffers)
+{
+	GstCaps *caps;
+	gboolean need_pool;
+	GstAllocationParams params;
+
+	gst_query_parse_allocation(query, &caps, &need_pool);
+	gst_allocation_params_init(&params);
+	params.align = sysconf(_SC_PAGESIZE) - 1;
+	gst_query_add_allocation_param(query, NULL, &params);
+
+	if (need_pool && caps)
 	{
-		while (last->next) last = last->next;
-		last->next = entry;
+		GstBufferPool *pool = gst_buffer_pool_new();
+		GstStructure *config = gst_buffer_pool_get_config(pool);
+		gst_buffer_pool_config_set_params(config, caps, size, min_buffers, 0);
+		gst_buffer_pool_config_set_allocator(config, NULL, &params);
+		if (!gst_buffer_pool_set_config(pool, config))
+		{
+			gst_object_unref(pool);
+			return FALSE;
+		}
+		gst_query_add_allocation_pool(query, pool, size, min_buffers, 0);
+		gst_object_unref(pool);
 	}
-	entry->next = NULL;
+	return TRUE;
+}
+
+void queue_init(write_queue_t *queue)
+{
+	queue->entries = NULL;
+	queue->capacity = 0;
+	queue->head = 0;
+	queue->count = 0;
+	queue->bytes = 0;
+}
+
+void queue_free(write_queue_t *queue)
+{
+	queue_clear(queue);
+	g_free(queue->entries);
+	queue_init(queue);
+}
+
+void queue_clear(write_queue_t *queue)
+{
+	while (queue->count) queue_pop(queue);
+	queue->head = 0;
+}
+
+static void queue_grow(write_queue_t *queue)
+{
+	guint capacity = queue->capacity ? queue->capacity * 2 : QUEUE_INITIAL_CAPACITY;
+	queue_entry_t *entries = g_new(queue_entry_t, capacity);
+	if (queue->count)
+	{
+		/* unwrap the ring, so the oldest entry ends up at index 0 */
+		guint first = MIN(queue->count, queue->capacity - queue->head);
+		memcpy(entries, queue->entries + queue->head, first * sizeof(queue_entry_t));
+		memcpy(entries + first, queue->entries, (queue->count - first) * sizeof(queue_entry_t));
+	}
+	g_free(queue->entries);
+	queue->entries = entries;
+	queue->capacity = capacity;
+	queue->head = 0;
+}
+
+void queue_push(write_queue_t *queue, GstBuffer *buffer, size_t start, size_t end)
+{
+	queue_entry_t *entry;
+	if (end <= start) return;
+	if (queue->count)
+	{
+		/* extend the last entry when this range directly follows it */
+		entry = &queue->entries[(queue->head + queue->count - 1) & (queue->capacity - 1)];
+		if (entry->buffer == buffer && entry->end == start)
+		{
+			entry->end = end;
+			queue->bytes += end - start;
+			return;
+		}
+	}
+	if (queue->count == queue->capacity) queue_grow(queue);
+	entry = &queue->entries[(queue->head + queue->count) & (queue->capacity - 1)];
+	/* the queued range is only read, so a reference is enough */
+	entry->buffer = gst_buffer_ref(buffer);
+	entry->start = start;
+	entry->end = end;
+	queue->count++;
+	queue->bytes += end - start;
 }
 
-void queue_pop(queue_entry_t **queue_base)
+void queue_pop(write_queue_t *queue)
 {
-	queue_entry_t *base = *queue_base;
-	*queue_base = base->next;
-	gst_buffer_unref(base->buffer);
-	g_free(base);
+	queue_entry_t *entry;
+	if (!queue->count) return;
+	entry = &queue->entries[queue->head];
+	queue->bytes -= entry->end - entry->start;
+	gst_buffer_unref(entry->buffer);
+	entry->buffer = NULL;
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	queue->count--;
 }
 
-int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, size_t *end)
+void queue_advance(write_queue_t *queue, size_t written)
 {
-	if (!*queue_base)
+	queue_entry_t *entry;
+	if (!queue->count) return;
+	entry = &queue->entries[queue->head];
+	if (written >= entry->end - entry->start)
+	{
+		queue_pop(queue);
+	}
+	else
+	{
+		entry->start += written;
+		queue->bytes -= written;
+	}
+}
+
+int queue_front(write_queue_t *queue, GstBuffer **buffer, size_t *start, size_t *end)
+{
+	if (!queue->count)
 	{
 		*buffer = NULL;
 		*start = 0;
@@ -50,7 +189,7 @@ int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, s
 	}
 	else
 	{
-		queue_entry_t *entry = *queue_base;
+		queue_entry_t *entry = &queue->entries[queue->head];
 		*buffer = entry->buffer;
 		*start = entry->start;
 		*end = entry->end;
@@ -58,6 +197,493 @@ int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, s
 	}
 }
 
+void pes_packet_init(pes_packet_t *packet)
+{
+	packet->iov = packet->inline_iov;
+	packet->segment = packet->inline_segment;
+	packet->first = 0;
+	packet->count = 0;
+	packet->capacity = PES_INLINE_SEGMENTS;
+	packet->size = 0;
+	packet->created = g_get_monotonic_time();
+}
+
+void pes_packet_free(pes_packet_t *packet)
+{
+	if (packet->iov != packet->inline_iov)
+	{
+		g_free(packet->iov);
+		g_free(packet->segment);
+	}
+	pes_packet_init(packet);
+}
+
+static void pes_packet_grow(pes_packet_t *packet)
+{
+	int capacity = packet->capacity * 2;
+	if (packet->iov == packet->inline_iov)
+	{
+		packet->iov = g_new(struct iovec, capacity);
+		packet->segment = g_new(pes_segment_t, capacity);
+		memcpy(packet->iov, packet->inline_iov, packet->count * sizeof(struct iovec));
+		memcpy(packet->segment, packet->inline_segment, packet->count * sizeof(pes_segment_t));
+	}
+	else
+	{
+		packet->iov = g_renew(struct iovec, packet->iov, capacity);
+		packet->segment = g_renew(pes_segment_t, packet->segment, capacity);
+	}
+	packet->capacity = capacity;
+}
+
+void pes_packet_add(pes_packet_t *packet, GstBuffer *buffer, size_t offset, const guint8 *data, size_t size)
+{
+	if (!size) return;
+	if (packet->count >= packet->capacity) pes_packet_grow(packet);
+	packet->iov[packet->count].iov_base = (void*)data;
+	packet->iov[packet->count].iov_len = size;
+	packet->segment[packet->count].buffer = buffer;
+	packet->segment[packet->count].offset = offset;
+	packet->count++;
+	packet->size += size;
+}
+
+int pes_packet_write(pes_packet_t *packet, int fd)
+{
+	/* writev() refuses more than IOV_MAX segments, the rest goes with the next call */
+	return writev(fd, packet->iov + packet->first, MIN(packet->count - packet->first, IOV_MAX));
+}
+
+void pes_packet_consume(pes_packet_t *packet, size_t written)
+{
+	while (written && packet->first < packet->count)
+	{
+		struct iovec *iov = &packet->iov[packet->first];
+		if (written >= iov->iov_len)
+		{
+			/* segment completely written, continue with the next one */
+			written -= iov->iov_len;
+			packet->size -= iov->iov_len;
+			packet->first++;
+		}
+		else
+		{
+			/* partial write, the rest of this segment is still pending */
+			iov->iov_base = (guint8*)iov->iov_base + written;
+			iov->iov_len -= written;
+			packet->segment[packet->first].offset += written;
+			packet->size -= written;
+			written = 0;
+		}
+	}
+}
+
+void pes_packet_queue(pes_packet_t *packet, write_queue_t *queue)
+{
+	int i;
+	for (i = packet->first; i < packet->count; i++)
+	{
+		struct iovec *iov = &packet->iov[i];
+		pes_segment_t *segment = &packet->segment[i];
+		if (segment->buffer)
+		{
+			queue_push(queue, segment->buffer, segment->offset, segment->offset + iov->iov_len);
+		}
+		else
+		{
+			/* scratch memory gets reused for the next packet, so we need a copy */
+			GstBuffer *buffer = gst_buffer_new_wrapped(g_memdup(iov->iov_base, iov->iov_len), iov->iov_len);
+			queue_push(queue, buffer, 0, iov->iov_len);
+			gst_buffer_unref(buffer);
+		}
+	}
+	packet->first = packet->count;
+	packet->size = 0;
+}
+
+gboolean pes_ring_start(pes_ring_t *ring, guint size, const gchar *name, GThreadFunc writer, gpointer data)
+{
+	guint i;
+	ring->size = 1;
+	while (ring->size < size) ring->size <<= 1;
+	ring->slots = g_new0(pes_ring_slot_t, ring->size);
+	for (i = 0; i < ring->size; i++) pes_packet_init(&ring->slots[i].packet);
+	ring->head = ring->tail = 0;
+	ring->bytes = ring->time_us = 0;
+	ring->producer_waiting = ring->consumer_waiting = 0;
+	ring->running = 1;
+	g_mutex_init(&ring->lock);
+	g_cond_init(&ring->cond);
+	ring->thread = g_thread_try_new(name, writer, data, NULL);
+	if (!ring->thread)
+	{
+		pes_ring_stop(ring);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void pes_ring_stop(pes_ring_t *ring)
+{
+	guint i;
+	if (!ring->slots) return;
+	g_atomic_int_set(&ring->running, 0);
+	pes_ring_wakeup(ring);
+	if (ring->thread)
+	{
+		g_thread_join(ring->thread);
+		ring->thread = NULL;
+	}
+	while (ring->head != ring->tail) pes_ring_pop(ring);
+	for (i = 0; i < ring->size; i++) g_free(ring->slots[i].scratch);
+	g_free(ring->slots);
+	ring->slots = NULL;
+	g_mutex_clear(&ring->lock);
+	g_cond_clear(&ring->cond);
+}
+
+static const guint8 *pes_ring_slot_map(pes_ring_slot_t *slot, GstBuffer *buffer, size_t offset)
+{
+	int i;
+	for (i = 0; i < slot->owners; i++)
+	{
+		if (slot->owner[i] == buffer) return slot->map[i].data + offset;
+	}
+	if (slot->owners >= PES_RING_MAX_OWNERS) return NULL;
+	/* render unmaps its buffers when it returns, the slot holds its own ref and mapping until pop */
+	if (!gst_buffer_map(buffer, &slot->map[i], GST_MAP_READ)) return NULL;
+	slot->owner[i] = gst_buffer_ref(buffer);
+	slot->owners++;
+	return slot->map[i].data + offset;
+}
+
+static void pes_ring_slot_release(pes_ring_slot_t *slot)
+{
+	int i;
+	for (i = 0; i < slot->owners; i++)
+	{
+		gst_buffer_unmap(slot->owner[i], &slot->map[i]);
+		gst_buffer_unref(slot->owner[i]);
+	}
+	slot->owners = 0;
+	pes_packet_free(&slot->packet);
+}
+
+int pes_ring_push(pes_ring_t *ring, pes_packet_t *packet, GstClockTime duration, pes_ring_cancel_func cancel, gpointer data)
+{
+	guint tail = ring->tail;
+	pes_ring_slot_t *slot;
+	gsize scratch_size = 0, pos = 0;
+	int i;
+
+	if (tail - g_atomic_int_get(&ring->head) >= ring->size)
+	{
+		g_mutex_lock(&ring->lock);
+		g_atomic_int_set(&ring->producer_waiting, 1);
+		while (tail - g_atomic_int_get(&ring->head) >= ring->size && g_atomic_int_get(&ring->running) && !cancel(data))
+		{
+			g_cond_wait(&ring->cond, &ring->lock);
+		}
+		g_atomic_int_set(&ring->producer_waiting, 0);
+		g_mutex_unlock(&ring->lock);
+		if (tail - g_atomic_int_get(&ring->head) >= ring->size) return 0;
+	}
+
+	slot = &ring->slots[tail & (ring->size - 1)];
+	for (i = packet->first; i < packet->count; i++)
+	{
+		if (!packet->segment[i].buffer) scratch_size += packet->iov[i].iov_len;
+	}
+	if (scratch_size > slot->scratch_size)
+	{
+		g_free(slot->scratch);
+		slot->scratch = g_malloc(scratch_size);
+		slot->scratch_size = scratch_size;
+	}
+	pes_packet_init(&slot->packet);
+	slot->packet.created = packet->created;
+	slot->owners = 0;
+	for (i = packet->first; i < packet->count; i++)
+	{
+		struct iovec *iov = &packet->iov[i];
+		pes_segment_t *segment = &packet->segment[i];
+		if (segment->buffer)
+		{
+			const guint8 *ptr = pes_ring_slot_map(slot, segment->buffer, segment->offset);
+			if (!ptr)
+			{
+				/* the header counts these bytes, so the packet cannot go without them */
+				GST_DEBUG("pes ring cannot hold segment %d of the packet", i);
+				pes_ring_slot_release(slot);
+				return -1;
+			}
+			pes_packet_add(&slot->packet, segment->buffer, segment->offset, ptr, iov->iov_len);
+		}
+		else
+		{
+			/* scratch memory gets reused for the next packet, so we need a copy */
+			memcpy(slot->scratch + pos, iov->iov_base, iov->iov_len);
+			pes_packet_add(&slot->packet, NULL, 0, slot->scratch + pos, iov->iov_len);
+			pos += iov->iov_len;
+		}
+	}
+	slot->duration_us = GST_CLOCK_TIME_IS_VALID(duration) ? duration / GST_USECOND : 0;
+	g_atomic_int_add(&ring->bytes, slot->packet.size);
+	g_atomic_int_add(&ring->time_us, slot->duration_us);
+	packet->first = packet->count;
+	packet->size = 0;
+
+	/* publish the slot */
+	g_atomic_int_set(&ring->tail, tail + 1);
+	if (g_atomic_int_get(&ring->consumer_waiting)) pes_ring_wakeup(ring);
+	return 1;
+}
+
+pes_ring_slot_t *pes_ring_peek(pes_ring_t *ring)
+{
+	guint head = ring->head;
+	if (head == g_atomic_int_get(&ring->tail))
+	{
+		g_mutex_lock(&ring->lock);
+		g_atomic_int_set(&ring->consumer_waiting, 1);
+		/* an idle writer might be what someone waits for */
+		g_cond_broadcast(&ring->cond);
+		while (head == g_atomic_int_get(&ring->tail) && g_atomic_int_get(&ring->running))
+		{
+			g_cond_wait(&ring->cond, &ring->lock);
+		}
+		g_atomic_int_set(&ring->consumer_waiting, 0);
+		g_mutex_unlock(&ring->lock);
+	}
+	if (!g_atomic_int_get(&ring->running)) return NULL;
+	return &ring->slots[head & (ring->size - 1)];
+}
+
+void pes_ring_pop(pes_ring_t *ring)
+{
+	guint head = ring->head;
+	pes_ring_slot_t *slot = &ring->slots[head & (ring->size - 1)];
+	g_atomic_int_add(&ring->bytes, -(gint)(slot->packet.size));
+	g_atomic_int_add(&ring->time_us, -slot->duration_us);
+	pes_ring_slot_release(slot);
+
+	/* release the slot */
+	g_atomic_int_set(&ring->head, head + 1);
+	if (g_atomic_int_get(&ring->producer_waiting)) pes_ring_wakeup(ring);
+}
+
+gboolean pes_ring_wait_idle(pes_ring_t *ring, pes_ring_cancel_func cancel, gpointer data)
+{
+	gboolean idle;
+	g_mutex_lock(&ring->lock);
+	while (!(idle = (g_atomic_int_get(&ring->head) == g_atomic_int_get(&ring->tail) && g_atomic_int_get(&ring->consumer_waiting)))
+		&& g_atomic_int_get(&ring->running) && !(cancel && cancel(data)))
+	{
+		g_cond_wait(&ring->cond, &ring->lock);
+	}
+	g_mutex_unlock(&ring->lock);
+	return idle;
+}
+
+void pes_ring_wakeup(pes_ring_t *ring)
+{
+	g_mutex_lock(&ring->lock);
+	g_cond_broadcast(&ring->cond);
+	g_mutex_unlock(&ring->lock);
+}
+
+static void sink_stats_begin(sink_stats_t *stats)
+{
+	g_atomic_int_inc(&stats->seq);
+}
+
+static void sink_stats_end(sink_stats_t *stats)
+{
+	g_atomic_int_inc(&stats->seq);
+}
+
+void sink_stats_reset(sink_stats_t *stats)
+{
+	sink_stats_begin(stats);
+	memset(&stats->bytes_written, 0, sizeof(*stats) - G_STRUCT_OFFSET(sink_stats_t, bytes_written));
+	sink_stats_end(stats);
+}
+
+static void sink_stats_histogram_add(guint64 *histogram, gint64 us)
+{
+	guint bucket = us > 0 ? g_bit_storage(us) : 0;
+	histogram[MIN(bucket, SINK_STATS_BUCKETS - 1)]++;
+}
+
+void sink_stats_poll(sink_stats_t *stats, gint64 start)
+{
+	gint64 waited = g_get_monotonic_time() - start;
+	sink_stats_begin(stats);
+	stats->poll_calls++;
+	stats->poll_wait_us += waited;
+	sink_stats_histogram_add(stats->poll_histogram, waited);
+	sink_stats_end(stats);
+}
+
+void sink_stats_write(sink_stats_t *stats, int wr, size_t wanted)
+{
+	int eagain = wr < 0 && errno == EAGAIN;
+	sink_stats_begin(stats);
+	stats->write_calls++;
+	if (eagain) stats->eagain++;
+	if (wr >= 0)
+	{
+		stats->bytes_written += wr;
+		if ((size_t)wr < wanted) stats->partial_writes++;
+	}
+	sink_stats_end(stats);
+}
+
+void sink_stats_packet(sink_stats_t *stats, pes_packet_t *packet)
+{
+	gint64 latency = g_get_monotonic_time() - packet->created;
+	sink_stats_begin(stats);
+	stats->packets++;
+	stats->latency_us += latency;
+	sink_stats_histogram_add(stats->latency_histogram, latency);
+	sink_stats_end(stats);
+}
+
+void sink_stats_queued(sink_stats_t *stats, guint64 bytes)
+{
+	if (bytes <= stats->queue_high_water) return;
+	sink_stats_begin(stats);
+	stats->queue_high_water = bytes;
+	sink_stats_end(stats);
+}
+
+static void sink_stats_set_histogram(GstStructure *structure, const gchar *field, const guint64 *histogram)
+{
+	GValue array = G_VALUE_INIT;
+	GValue value = G_VALUE_INIT;
+	int i;
+
+	g_value_init(&array, GST_TYPE_ARRAY);
+	g_value_init(&value, G_TYPE_UINT64);
+	for (i = 0; i < SINK_STATS_BUCKETS; i++)
+	{
+		g_value_set_uint64(&value, histogram[i]);
+		gst_value_array_append_value(&array, &value);
+	}
+	gst_structure_take_value(structure, field, &array);
+	g_value_unset(&value);
+}
+
+GstStructure *sink_stats_to_structure(const sink_stats_t *live, const gchar *name)
+{
+	sink_stats_t snapshot, *stats = &snapshot;
+	GstStructure *structure;
+	gint seq;
+
+	/* copy until no update ran in between */
+	while (1)
+	{
+		seq = g_atomic_int_get((volatile gint *)&live->seq);
+		if (seq & 1)
+		{
+			g_thread_yield();
+			continue;
+		}
+		memcpy(&snapshot, (const void *)live, sizeof(snapshot));
+		/* a read-modify-write, so the copy cannot move behind the check */
+		if (g_atomic_int_add((volatile gint *)&live->seq, 0) == seq) break;
+	}
+	structure = gst_structure_new(name,
+		"bytes-written", G_TYPE_UINT64, stats->bytes_written,
+		"packets", G_TYPE_UINT64, stats->packets,
+		"write-calls", G_TYPE_UINT64, stats->write_calls,
+		"partial-writes", G_TYPE_UINT64, stats->partial_writes,
+		"eagain", G_TYPE_UINT64, stats->eagain,
+		"poll-calls", G_TYPE_UINT64, stats->poll_calls,
+		"poll-wait-us", G_TYPE_UINT64, stats->poll_wait_us,
+		"latency-us", G_TYPE_UINT64, stats->latency_us,
+		"queue-high-water", G_TYPE_UINT64, stats->queue_high_water,
+		NULL);
+	sink_stats_set_histogram(structure, "poll-wait-histogram", stats->poll_histogram);
+	sink_stats_set_histogram(structure, "latency-histogram", stats->latency_histogram);
+	return structure;
+}
+
+void start_code_index_init(start_code_index_t *index, const guint8 *data, gsize size)
+{
+	index->data = data;
+	index->size = size;
+	index->scanned = FALSE;
+	index->offset = index->inline_offset;
+	index->count = 0;
+	index->capacity = START_CODE_INLINE;
+}
+
+void start_code_index_free(start_code_index_t *index)
+{
+	if (index->offset != index->inline_offset) g_free(index->offset);
+	index->offset = index->inline_offset;
+	index->count = 0;
+	index->capacity = START_CODE_INLINE;
+	index->scanned = FALSE;
+}
+
+static void start_code_index_scan(start_code_index_t *index)
+{
+	const guint8 *data = index->data;
+	const guint8 *end = data + index->size;
+	const guint8 *p = data + 2;
+
+	index->scanned = TRUE;
+	if (index->size < 3) return;
+	/* look for the 01 with memchr, the next prefix cannot end before three more bytes */
+	while (p < end && (p = memchr(p, 1, end - p)) != NULL)
+	{
+		if (!p[-1] && !p[-2])
+		{
+			if (index->count >= index->capacity)
+			{
+				index->capacity *= 2;
+				if (index->offset == index->inline_offset)
+				{
+					index->offset = g_new(guint, index->capacity);
+					memcpy(index->offset, index->inline_offset, sizeof(index->inline_offset));
+				}
+				else
+				{
+					index->offset = g_renew(guint, index->offset, index->capacity);
+				}
+			}
+			index->offset[index->count++] = p - 2 - data;
+		}
+		p += 3;
+	}
+}
+
+gssize start_code_find(start_code_index_t *index, gsize from, int code)
+{
+	guint low = 0, high;
+
+	if (!index->scanned) start_code_index_scan(index);
+	/* first entry at or after from */
+	high = index->count;
+	while (low < high)
+	{
+		guint mid = (low + high) / 2;
+		if (index->offset[mid] < from)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for (; low < index->count; low++)
+	{
+		gsize offset = index->offset[low];
+		if (code < 0) return offset;
+		if (offset + 3 < index->size && index->data[offset + 3] == code) return offset;
+	}
+	return -1;
+}
+
 void pes_set_pts(long long timestamp, unsigned char *pes_header)
 {
 	unsigned long long pts = timestamp * 9LL / 100000; /* convert ns to 90kHz */
@@ -75,6 +701,82 @@ void pes_set_payload_size(size_t size, unsigned char *pes_header)
 	pes_header[5] = size & 0xFF;
 }
 
+void pes_template_init(pes_template_t *template, guint8 stream_id)
+{
+	guint8 *header = template->header[0];
+	header[0] = 0;
+	header[1] = 0;
+	header[2] = 1;
+	header[3] = stream_id;
+	header[4] = 0;
+	header[5] = 0;
+	header[6] = 0x81;
+	header[7] = 0; /* no pts */
+	header[8] = 0;
+	template->size[0] = 9;
+
+	header = template->header[1];
+	memcpy(header, template->header[0], 9);
+	header[7] = 0x80; /* pts */
+	header[8] = 5; /* pts size */
+	memset(header + 9, 0, 5);
+	template->size[1] = 14;
+	template->length_field = -1;
+	template->length_extra = 0;
+	template->target = NULL;
+}
+
+gboolean pes_template_append(pes_template_t *template, const void *data, gsize size)
+{
+	int i;
+	if (template->size[1] + size > PES_TEMPLATE_MAX)
+	{
+		GST_WARNING("%u bytes do not fit the pes header", (guint)size);
+		return FALSE;
+	}
+	for (i = 0; i < 2; i++)
+	{
+		memcpy(template->header[i] + template->size[i], data, size);
+		template->size[i] += size;
+	}
+	template->target = NULL;
+	return TRUE;
+}
+
+gboolean pes_template_append_length(pes_template_t *template, gsize extra)
+{
+	static const guint8 length[4] = { 0 };
+	gssize offset = template->size[0];
+	if (!pes_template_append(template, length, sizeof(length))) return FALSE;
+	template->length_field = offset;
+	template->length_extra = extra;
+	return TRUE;
+}
+
+gsize pes_template_apply(pes_template_t *template, guint8 *pes_header, GstClockTime pts, gsize size)
+{
+	gboolean has_pts = pts != GST_CLOCK_TIME_NONE;
+	gsize len = template->size[has_pts];
+	if (template->target != pes_header || template->target_pts != has_pts)
+	{
+		memcpy(pes_header, template->header[has_pts], len);
+		template->target = pes_header;
+		template->target_pts = has_pts;
+	}
+	if (has_pts) pes_set_pts(pts, pes_header);
+	if (template->length_field >= 0)
+	{
+		/* behind the pts when there is one */
+		guint8 *field = pes_header + template->length_field + (has_pts ? 5 : 0);
+		gsize payload_len = size + template->length_extra;
+		field[0] = (payload_len >> 24) & 0xff;
+		field[1] = (payload_len >> 16) & 0xff;
+		field[2] = (payload_len >> 8) & 0xff;
+		field[3] = payload_len & 0xff;
+	}
+	return len;
+}
+
 void gst_sleepms(uint32_t msec)
 {
 	//does not interfere with signals like sleep and usleep do
@@ -119,32 +821,404 @@ void gst_sleepus(uint32_t usec)
 	errno = olderrno;
 }
 
-gboolean get_downmix_setting()
+gboolean wait_decoder_ready(int fd, int unlockfd, guint timeout_ms)
 {
-	gboolean ret = FALSE;
-	FILE *f;
-	char buffer[32] = {0};
-	f = fopen("/proc/stb/audio/ac3", "r");
-	if (f)
+	struct pollfd pfd[2];
+	gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+	int32_t olderrno = errno;
+	gboolean ret = TRUE;
+
+	pfd[0].fd = unlockfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLOUT;
+
+	while (1)
 	{
-		fread(buffer, sizeof(buffer), 1, f);
-		fclose(f);
+		gint64 remaining = deadline - g_get_monotonic_time();
+		if (remaining <= 0) break; // timeout, give up waiting
+		int rval = poll(pfd, 2, (remaining + 999) / 1000);
+		if (rval < 0 && errno == EINTR) continue;
+		if (rval <= 0) break;
+		/* pending unlock or flush, leave the wakeup byte to the write loop */
+		if (pfd[0].revents & POLLIN) ret = FALSE;
+		break;
 	}
-	ret = !strncmp(buffer, "downmix", 7);
+	errno = olderrno;
 	return ret;
 }
 
-gboolean get_downmix_ready()
+/* longest sleep before the depth is checked again */
+#define THROTTLE_MAX_WAIT (50 * GST_MSECOND)
+
+gint64 decoder_depth(gint64 written_position, gint64 position)
+{
+	if (written_position < 0 || position < 0) return -1;
+	return MAX(written_position - position, 0);
+}
+
+void decoder_throttle(GstElement *element, int unlockfd, decoder_depth_func depth, gpointer data,
+	guint target_ms, guint interval_ms, gint64 *reported, gboolean can_wait)
+{
+	gint64 target = (gint64)target_ms * GST_MSECOND;
+
+	while (1)
+	{
+		gint64 ahead = depth(data);
+		gint64 now = g_get_monotonic_time();
+		if (ahead < 0) return;
+		if (interval_ms && now - *reported >= (gint64)interval_ms * 1000)
+		{
+			*reported = now;
+			gst_element_post_message(element, gst_message_new_element(GST_OBJECT(element),
+				gst_structure_new("bufferDepth",
+					"depth", G_TYPE_UINT64, (guint64)ahead,
+					"target", G_TYPE_UINT64, (guint64)target, NULL)));
+		}
+		if (!target || ahead <= target || !can_wait) return;
+		GST_LOG_OBJECT(element, "%" GST_TIME_FORMAT " ahead of the decoder, throttle", GST_TIME_ARGS(ahead));
+		if (!wait_until(unlockfd, now + MIN(ahead - target, THROTTLE_MAX_WAIT) / GST_USECOND)) return;
+	}
+}
+
+gboolean wait_until(int unlockfd, gint64 deadline)
+{
+	struct pollfd pfd;
+	int32_t olderrno = errno;
+	gboolean ret = TRUE;
+
+	pfd.fd = unlockfd;
+	pfd.events = POLLIN;
+
+	while (1)
+	{
+		gint64 remaining = deadline - g_get_monotonic_time();
+		if (remaining <= 0) break;
+		int rval = poll(&pfd, 1, (remaining + 999) / 1000);
+		if (rval < 0 && errno == EINTR) continue;
+		if (rval < 0) break;
+		/* leave the wakeup byte to the write loop */
+		if (rval > 0 && (pfd.revents & POLLIN))
+		{
+			ret = FALSE;
+			break;
+		}
+	}
+	errno = olderrno;
+	return ret;
+}
+
+#define DOWNMIX_SETTING_FILE "/proc/stb/audio/ac3"
+
+static gboolean read_downmix_setting(void)
 {
-	gboolean ret = FALSE;
 	FILE *f;
 	char buffer[32] = {0};
-	f = fopen("/tmp/dtsdownmix", "r");
+	f = fopen(DOWNMIX_SETTING_FILE, "r");
 	if (f)
 	{
 		fread(buffer, sizeof(buffer), 1, f);
 		fclose(f);
 	}
-	ret = !strncmp(buffer, "READY", 5);
-	return ret;
+	return !strncmp(buffer, "downmix", 7);
+}
+
+/*
+ * State shared by the sinks and dtsdownmix. Each plugin links its own copy of this file,
+ * so it lives in the class of a GType which exists only once in the process.
+ */
+/* bump when shared_state_class_t changes, copies with another layout do not share */
+#define SHARED_STATE_VERSION 1
+
+typedef struct shared_state_class
+{
+	GObjectClass parent_class;
+	/* first, so it can be read whatever layout the registering copy had */
+	guint version;
+	volatile gint downmix_setting;
+	/* -1 until the first get_downmix_setting() and after the watch stopped */
+	int inotify_fd;
+	volatile gint watch_started;
+	/* dtsdownmix elements which are ready, with the top level bin they run in, only used as keys */
+	GMutex downmix_lock;
+	struct
+	{
+		gconstpointer element, bin;
+	} downmix[DOWNMIX_BINS_MAX];
+	/* decoder devices, shared so the sinks of one adapter reuse each other's fd */
+	GMutex device_lock;
+	dvb_device_t devices[DVB_DEVICE_MAX];
+} shared_state_class_t;
+
+typedef struct shared_state
+{
+	GObject parent;
+} shared_state_t;
+
+static gpointer shared_state_watch(gpointer data)
+{
+	shared_state_class_t *shared = data;
+	char events[sizeof(struct inotify_event) + NAME_MAX + 1];
+	int fd;
+
+	while (1)
+	{
+		ssize_t len = read(shared->inotify_fd, events, sizeof(events));
+		if (len < 0 && errno == EINTR) continue;
+		if (len <= 0) break;
+		/* procfs files only notify on writes from userspace, which is how the setting changes */
+		g_atomic_int_set(&shared->downmix_setting, read_downmix_setting());
+	}
+	/* watch failed, every query reads the file again */
+	GST_WARNING("downmix setting watch stopped");
+	fd = shared->inotify_fd;
+	g_atomic_int_set(&shared->inotify_fd, -1);
+	close(fd);
+	return NULL;
+}
+
+/* started by the first query, so processes which only load the plugins get no thread */
+static void shared_state_watch_start(shared_state_class_t *shared)
+{
+	GThread *thread = NULL;
+	int fd = inotify_init1(IN_CLOEXEC);
+
+	if (fd < 0) return;
+	if (inotify_add_watch(fd, DOWNMIX_SETTING_FILE, IN_MODIFY | IN_CLOSE_WRITE) >= 0)
+	{
+		g_atomic_int_set(&shared->downmix_setting, read_downmix_setting());
+		g_atomic_int_set(&shared->inotify_fd, fd);
+		thread = g_thread_try_new("dvbsink-downmix", shared_state_watch, shared, NULL);
+	}
+	if (thread)
+	{
+		g_thread_unref(thread);
+	}
+	else
+	{
+		g_atomic_int_set(&shared->inotify_fd, -1);
+		close(fd);
+	}
+}
+
+static void shared_state_class_init(shared_state_class_t *shared)
+{
+	shared->version = SHARED_STATE_VERSION;
+	g_mutex_init(&shared->device_lock);
+	g_mutex_init(&shared->downmix_lock);
+	shared->inotify_fd = -1;
+	shared->watch_started = 0;
+}
+
+static shared_state_class_t *shared_state_get(void)
+{
+	static shared_state_class_t *shared = NULL;
+
+	if (g_once_init_enter(&shared))
+	{
+		static shared_state_class_t private_state;
+		shared_state_class_t *state;
+		GstRegistry *registry = gst_registry_get();
+		GTypeQuery query;
+		GType type;
+
+		/*
+		 * the g_once above is per copy of this file, the registry lock is the one
+		 * every plugin in the process sees, so only one copy registers the type
+		 */
+		GST_OBJECT_LOCK(registry);
+		type = g_type_from_name("GstDVBSharedState");
+		if (!type)
+		{
+			type = g_type_register_static_simple(G_TYPE_OBJECT, "GstDVBSharedState",
+				sizeof(shared_state_class_t), (GClassInitFunc)shared_state_class_init,
+				sizeof(shared_state_t), NULL, 0);
+		}
+		GST_OBJECT_UNLOCK(registry);
+
+		/* never released, the state lives as long as the process */
+		state = g_type_class_ref(type);
+		g_type_query(type, &query);
+		if (query.class_size != sizeof(shared_state_class_t) || state->version != SHARED_STATE_VERSION)
+		{
+			GST_ERROR("shared state registered by another plugin build (class size %u), not sharing", query.class_size);
+			shared_state_class_init(&private_state);
+			state = &private_state;
+		}
+		g_once_init_leave(&shared, state);
+	}
+	return shared;
+}
+
+gboolean get_downmix_setting()
+{
+	shared_state_class_t *shared = shared_state_get();
+	if (g_atomic_int_compare_and_exchange(&shared->watch_started, 0, 1))
+	{
+		shared_state_watch_start(shared);
+	}
+	if (g_atomic_int_get(&shared->inotify_fd) < 0)
+	{
+		return read_downmix_setting();
+	}
+	return g_atomic_int_get(&shared->downmix_setting);
+}
+
+/* the pipeline an element runs in */
+static gconstpointer downmix_bin(GstElement *element)
+{
+	GstObject *object = GST_OBJECT(element);
+	gconstpointer top;
+
+	gst_object_ref(object);
+	while (1)
+	{
+		GstObject *parent = gst_object_get_parent(object);
+		if (!parent) break;
+		gst_object_unref(object);
+		object = parent;
+	}
+	top = object;
+	gst_object_unref(object);
+	return top;
+}
+
+gboolean get_downmix_ready(GstElement *element)
+{
+	shared_state_class_t *shared = shared_state_get();
+	gconstpointer bin = downmix_bin(element);
+	gboolean ready = FALSE;
+	int i;
+
+	g_mutex_lock(&shared->downmix_lock);
+	for (i = 0; i < DOWNMIX_BINS_MAX && !ready; i++)
+	{
+		ready = shared->downmix[i].element && shared->downmix[i].bin == bin;
+	}
+	g_mutex_unlock(&shared->downmix_lock);
+	return ready;
+}
+
+void set_downmix_ready(GstElement *element, gboolean ready)
+{
+	shared_state_class_t *shared = shared_state_get();
+	gconstpointer bin = ready ? downmix_bin(element) : NULL;
+	int i;
+
+	g_mutex_lock(&shared->downmix_lock);
+	for (i = 0; i < DOWNMIX_BINS_MAX; i++)
+	{
+		/* cleared by element, it may have left its bin by now */
+		if (shared->downmix[i].element == (ready ? NULL : element))
+		{
+			shared->downmix[i].element = ready ? element : NULL;
+			shared->downmix[i].bin = bin;
+			break;
+		}
+	}
+	g_mutex_unlock(&shared->downmix_lock);
+	if (ready && i == DOWNMIX_BINS_MAX) GST_WARNING_OBJECT(element, "too many downmix pipelines");
+}
+
+int dvb_device_open(const char *type, guint adapter, guint index, gboolean exclusive)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/dev/dvb/adapter%u/%s%u", adapter, type, index);
+	return dvb_device_open_path(path, exclusive);
+}
+
+int dvb_device_open_path(const char *path, gboolean exclusive)
+{
+	shared_state_class_t *shared = shared_state_get();
+	dvb_device_t *slot = NULL;
+	int fd = -1, olderrno;
+	int i;
+
+	g_mutex_lock(&shared->device_lock);
+	for (i = 0; i < DVB_DEVICE_MAX; i++)
+	{
+		dvb_device_t *device = &shared->devices[i];
+		if (!device->refcount)
+		{
+			if (!slot) slot = device;
+		}
+		else if (!strcmp(device->path, path))
+		{
+			/* another sink writes to this decoder, as the driver would refuse a second open */
+			if (exclusive)
+			{
+				GST_WARNING("%s is in use", path);
+				g_mutex_unlock(&shared->device_lock);
+				errno = EBUSY;
+				return -1;
+			}
+			device->refcount++;
+			fd = device->fd;
+			break;
+		}
+	}
+	if (fd < 0)
+	{
+		if (slot)
+		{
+			fd = open(path, O_RDWR | O_NONBLOCK);
+			if (fd >= 0)
+			{
+				g_strlcpy(slot->path, path, sizeof(slot->path));
+				slot->fd = fd;
+				slot->refcount = 1;
+			}
+		}
+		else
+		{
+			GST_WARNING("no free slot for %s", path);
+			errno = EMFILE;
+		}
+	}
+	olderrno = errno;
+	g_mutex_unlock(&shared->device_lock);
+	errno = olderrno;
+	return fd;
+}
+
+guint dvb_device_users(int fd)
+{
+	shared_state_class_t *shared = shared_state_get();
+	guint users = 0;
+	int i;
+
+	g_mutex_lock(&shared->device_lock);
+	for (i = 0; i < DVB_DEVICE_MAX; i++)
+	{
+		if (shared->devices[i].refcount && shared->devices[i].fd == fd)
+		{
+			users = shared->devices[i].refcount;
+			break;
+		}
+	}
+	g_mutex_unlock(&shared->device_lock);
+	return users;
+}
+
+void dvb_device_close(int fd)
+{
+	shared_state_class_t *shared = shared_state_get();
+	int i;
+
+	if (fd < 0) return;
+	g_mutex_lock(&shared->device_lock);
+	for (i = 0; i < DVB_DEVICE_MAX; i++)
+	{
+		dvb_device_t *device = &shared->devices[i];
+		if (device->refcount && device->fd == fd)
+		{
+			if (--device->refcount == 0)
+			{
+				close(fd);
+				device->fd = -1;
+			}
+			break;
+		}
+	}
+	g_mutex_unlock(&shared->device_lock);
 }
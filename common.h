@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/dvb/audio.h>
 #include <linux/dvb/video.h>
 #include <fcntl.h>
@@ -19,21 +20,261 @@
 typedef struct queue_entry
 {
 	GstBuffer *buffer;
-	struct queue_entry *next;
 	size_t start;
 	size_t end;
 } queue_entry_t;
 
-void queue_push(queue_entry_t **queue_base, GstBuffer *buffer, size_t start, size_t end);
-void queue_pop(queue_entry_t **queue_base);
-int queue_front(queue_entry_t **queue_base, GstBuffer **buffer, size_t *start, size_t *end);
+/* a buffer kept mapped for as long as the sink holds on to it */
+typedef struct mapped_buffer
+{
+	GstBuffer *buffer;
+	GstMapInfo map;
+} mapped_buffer_t;
+
+gboolean mapped_buffer_alloc(mapped_buffer_t *mapped, gsize size);
+void mapped_buffer_set(mapped_buffer_t *mapped, GstBuffer *buffer);
+void mapped_buffer_release(mapped_buffer_t *mapped);
+
+gboolean buffer_equal(GstBuffer *a, GstBuffer *b);
+/*
+ * answer an allocation query with page aligned memory, which drivers can take
+ * straight from the user pages on write; size and min_buffers are only used
+ * for the pool, which is added when upstream asks for one
+ */
+gboolean propose_page_allocation(GstQuery *query, guint size, guint min_buffers);
+
+#define QUEUE_INITIAL_CAPACITY 64
+
+/* pending writes, kept in a ring which doubles in size when it runs full */
+typedef struct write_queue
+{
+	queue_entry_t *entries;
+	guint capacity; /* zero or a power of two */
+	guint head;
+	guint count;
+	guint64 bytes;
+} write_queue_t;
+
+void queue_init(write_queue_t *queue);
+void queue_free(write_queue_t *queue);
+void queue_clear(write_queue_t *queue);
+void queue_push(write_queue_t *queue, GstBuffer *buffer, size_t start, size_t end);
+void queue_pop(write_queue_t *queue);
+void queue_advance(write_queue_t *queue, size_t written);
+int queue_front(write_queue_t *queue, GstBuffer **buffer, size_t *start, size_t *end);
+
+/* enough for a typical frame, packets with more segments grow on the heap */
+#define PES_INLINE_SEGMENTS 32
+
+typedef struct pes_segment
+{
+	GstBuffer *buffer; /* owner of the data, NULL for sink scratch memory */
+	size_t offset; /* offset of the data within buffer */
+} pes_segment_t;
+
+/* all pieces of one PES packet, submitted with a single writev() */
+typedef struct pes_packet
+{
+	struct iovec *iov;
+	pes_segment_t *segment;
+	int first;
+	int count;
+	int capacity;
+	size_t size;
+	/* monotonic time in us the packet was started, for the render to write latency */
+	gint64 created;
+	struct iovec inline_iov[PES_INLINE_SEGMENTS];
+	pes_segment_t inline_segment[PES_INLINE_SEGMENTS];
+} pes_packet_t;
+
+void pes_packet_init(pes_packet_t *packet);
+void pes_packet_free(pes_packet_t *packet);
+void pes_packet_add(pes_packet_t *packet, GstBuffer *buffer, size_t offset, const guint8 *data, size_t size);
+int pes_packet_write(pes_packet_t *packet, int fd);
+void pes_packet_consume(pes_packet_t *packet, size_t written);
+void pes_packet_queue(pes_packet_t *packet, write_queue_t *queue);
+
+#define PES_RING_MAX_OWNERS 8
+#define PES_RING_DEFAULT_SIZE 32
+
+/* a PES packet handed from render to the writer thread */
+typedef struct pes_ring_slot
+{
+	pes_packet_t packet;
+	GstBuffer *owner[PES_RING_MAX_OWNERS];
+	GstMapInfo map[PES_RING_MAX_OWNERS];
+	int owners;
+	guint8 *scratch; /* copy of the sink scratch memory of this packet */
+	gsize scratch_size;
+	gint duration_us;
+} pes_ring_slot_t;
+
+typedef gboolean (*pes_ring_cancel_func)(gpointer data);
+
+/*
+ * Single producer, single consumer ring of PES packets. The indices are only
+ * updated with atomic operations, the mutex is used to sleep on a full or
+ * empty ring.
+ */
+typedef struct pes_ring
+{
+	pes_ring_slot_t *slots;
+	guint size; /* a power of two */
+	volatile guint head; /* next slot to write out, owned by the writer thread */
+	volatile guint tail; /* next free slot, owned by render */
+	volatile gint bytes;
+	volatile gint time_us;
+	volatile gint producer_waiting;
+	volatile gint consumer_waiting;
+	volatile gint running;
+	GMutex lock;
+	GCond cond;
+	GThread *thread;
+} pes_ring_t;
+
+gboolean pes_ring_start(pes_ring_t *ring, guint size, const gchar *name, GThreadFunc writer, gpointer data);
+void pes_ring_stop(pes_ring_t *ring);
+/*
+ * queue packet, returns 1 when it is queued, 0 when it is dropped because the ring stopped or
+ * cancel returned TRUE, -1 when a slot cannot hold it (too many buffers or a failed map). On -1
+ * the packet is left to the caller, which writes it itself once the ring is idle.
+ */
+int pes_ring_push(pes_ring_t *ring, pes_packet_t *packet, GstClockTime duration, pes_ring_cancel_func cancel, gpointer data);
+pes_ring_slot_t *pes_ring_peek(pes_ring_t *ring);
+void pes_ring_pop(pes_ring_t *ring);
+gboolean pes_ring_wait_idle(pes_ring_t *ring, pes_ring_cancel_func cancel, gpointer data);
+void pes_ring_wakeup(pes_ring_t *ring);
+
+/*
+ * write path counters, only updated by the thread writing to the decoder.
+ * Histogram bucket 0 counts 0 us, bucket n counts [2^(n-1), 2^n) us and the
+ * last bucket everything above.
+ */
+#define SINK_STATS_BUCKETS 20
+typedef struct sink_stats
+{
+	/* odd while the writer updates, the 64 bit counters cannot be read atomically on 32 bit boxes */
+	volatile gint seq;
+	guint64 bytes_written;
+	guint64 packets;
+	guint64 write_calls;
+	guint64 partial_writes;
+	guint64 eagain;
+	guint64 poll_calls;
+	guint64 poll_wait_us;
+	guint64 latency_us;
+	guint64 queue_high_water;
+	guint64 poll_histogram[SINK_STATS_BUCKETS];
+	guint64 latency_histogram[SINK_STATS_BUCKETS];
+} sink_stats_t;
+
+void sink_stats_reset(sink_stats_t *stats);
+/* poll() returned, start is the monotonic time it was entered */
+void sink_stats_poll(sink_stats_t *stats, gint64 start);
+/* a write() or writev() of wanted bytes returned wr, call before errno changes */
+void sink_stats_write(sink_stats_t *stats, int wr, size_t wanted);
+/* the last byte of packet was written */
+void sink_stats_packet(sink_stats_t *stats, pes_packet_t *packet);
+void sink_stats_queued(sink_stats_t *stats, guint64 bytes);
+/* consistent snapshot as a structure, retried while the writer updates */
+GstStructure *sink_stats_to_structure(const sink_stats_t *stats, const gchar *name);
+
+/* positions of the 00 00 01 start code prefixes in a buffer, scanned once on first use */
+#define START_CODE_INLINE 64
+typedef struct start_code_index
+{
+	const guint8 *data;
+	gsize size;
+	gboolean scanned;
+	guint *offset;
+	guint count;
+	guint capacity;
+	guint inline_offset[START_CODE_INLINE];
+} start_code_index_t;
+
+void start_code_index_init(start_code_index_t *index, const guint8 *data, gsize size);
+void start_code_index_free(start_code_index_t *index);
+/* first start code at or after from followed by code (any byte when code < 0), -1 if there is none */
+gssize start_code_find(start_code_index_t *index, gsize from, int code);
 
 void pes_set_pts(long long timestamp, unsigned char *pes_header);
 void pes_set_payload_size(size_t size, unsigned char *pes_header);
 
+#define PES_TEMPLATE_MAX 256
+
+/*
+ * PES header of a stream, built in set_caps. Packets copy it and only get
+ * the pts and the length fields filled in.
+ */
+typedef struct pes_template
+{
+	/* without and with a pts */
+	guint8 header[2][PES_TEMPLATE_MAX];
+	gsize size[2];
+	/* offset (without pts) of a 32 bit payload length some codecs carry, -1 for none */
+	gssize length_field;
+	gsize length_extra;
+	/* the header buffer already holding a copy, and of which variant */
+	guint8 *target;
+	gboolean target_pts;
+} pes_template_t;
+
+/* start code, stream_id and flags, no stream specific data */
+void pes_template_init(pes_template_t *template, guint8 stream_id);
+/* stream specific bytes behind the pts */
+gboolean pes_template_append(pes_template_t *template, const void *data, gsize size);
+/* a 32 bit field filled with the payload size plus extra on every packet */
+gboolean pes_template_append_length(pes_template_t *template, gsize extra);
+/*
+ * fill in the header for a packet with size payload bytes, pts may be GST_CLOCK_TIME_NONE,
+ * returns the header length. The template is only copied when pes_header does not hold
+ * it yet, so the caller must not change pes_header below the returned length.
+ */
+gsize pes_template_apply(pes_template_t *template, guint8 *pes_header, GstClockTime pts, gsize size);
+
 void gst_sleepms(uint32_t msec);
 void gst_sleepus(uint32_t usec);
+/* wait until the decoder accepts data, an unlock is signalled, or timeout_ms passed */
+gboolean wait_decoder_ready(int fd, int unlockfd, guint timeout_ms);
+/* sleep until the monotonic deadline (us), returns FALSE when an unlock is signalled first */
+gboolean wait_until(int unlockfd, gint64 deadline);
+/* time written ahead of the decoder position, -1 while either is unknown */
+gint64 decoder_depth(gint64 written_position, gint64 position);
+typedef gint64 (*decoder_depth_func)(gpointer data);
+/*
+ * wait while depth(data) is more than target_ms, and post a bufferDepth message on element
+ * every interval_ms (0 = never), reported holds the time of the last one. Only waits when
+ * can_wait, a pause, flush or unlock after that is seen through unlockfd.
+ */
+void decoder_throttle(GstElement *element, int unlockfd, decoder_depth_func depth, gpointer data,
+	guint target_ms, guint interval_ms, gint64 *reported, gboolean can_wait);
 gboolean get_downmix_setting();
-gboolean get_downmix_ready();
+#define DOWNMIX_BINS_MAX 8
+/* whether a dtsdownmix is ready in the pipeline of element */
+gboolean get_downmix_ready(GstElement *element);
+/* called by dtsdownmix, marks its own pipeline */
+void set_downmix_ready(GstElement *element, gboolean ready);
+
+#define DVB_DEVICE_MAX 8
+
+typedef struct dvb_device
+{
+	char path[64];
+	int fd;
+	guint refcount;
+} dvb_device_t;
+
+/*
+ * open /dev/dvb/adapter<adapter>/<type><index> read/write and non-blocking, or take
+ * another reference on the fd when any plugin in the process already has it open.
+ * An exclusive open, for the decoder a sink writes to, fails with EBUSY instead.
+ */
+int dvb_device_open(const char *type, guint adapter, guint index, gboolean exclusive);
+/* the same for an explicit device node */
+int dvb_device_open_path(const char *path, gboolean exclusive);
+/* number of references held on an fd from dvb_device_open */
+guint dvb_device_users(int fd);
+/* drop a reference taken by dvb_device_open, the last one closes the fd */
+void dvb_device_close(int fd);
 
 #endif
@@ -0,0 +1,219 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * dvbbench: plays sample streams through the sinks of this tree and reports
+ * frames per second, CPU time per frame and allocations per frame.
+ * Run it with libfakedvb preloaded (make benchmark) to measure without a
+ * decoder, or on a box to measure against the real one.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <gst/gst.h>
+
+typedef struct bench_case
+{
+	const gchar *name;
+	const gchar *file;
+	/* %s is the sample file */
+	const gchar *pipeline;
+} bench_case_t;
+
+static const bench_case_t cases[] =
+{
+	{ "H.264", "sample.h264", "filesrc location=\"%s\" ! h264parse ! dvbvideosink name=sink" },
+	{ "MPEG-2", "sample.m2v", "filesrc location=\"%s\" ! mpegvideoparse ! dvbvideosink name=sink" },
+	{ "AAC", "sample.aac", "filesrc location=\"%s\" ! aacparse ! dvbaudiosink name=sink" },
+	{ "PCM", "sample.wav", "filesrc location=\"%s\" ! wavparse ! dvbaudiosink name=sink" },
+	{ "DTS", "sample.dts", "filesrc location=\"%s\" ! dcaparse ! dtsdownmix ! dvbaudiosink name=sink" },
+};
+
+static volatile unsigned long *allocations = NULL;
+
+static GstPadProbeReturn bench_count_frame(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+	guint64 *frames = user_data;
+	(*frames)++;
+	return GST_PAD_PROBE_OK;
+}
+
+static gint64 bench_cpu_us(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static gboolean bench_run(const bench_case_t *bench, const gchar *dir, gint iterations)
+{
+	gchar *file = g_build_filename(dir, bench->file, NULL);
+	gchar *description = NULL;
+	GstElement *pipeline, *sink;
+	GstPad *pad;
+	GError *error = NULL;
+	guint64 frames = 0;
+	gint64 wall = 0, cpu = 0;
+	unsigned long allocs = 0;
+	gboolean ok = FALSE;
+	gint i;
+
+	if (!g_file_test(file, G_FILE_TEST_EXISTS))
+	{
+		printf("%-8s skipped, %s not found\n", bench->name, file);
+		ok = TRUE;
+		goto done;
+	}
+	description = g_strdup_printf(bench->pipeline, file);
+	for (i = 0; i < iterations; i++)
+	{
+		GstBus *bus;
+		GstMessage *msg;
+		gint64 start_wall, start_cpu;
+		unsigned long start_allocs;
+
+		pipeline = gst_parse_launch(description, &error);
+		if (!pipeline || error)
+		{
+			/* usually an element which is not built or installed */
+			printf("%-8s skipped, %s\n", bench->name, error ? error->message : "cannot build pipeline");
+			if (pipeline) gst_object_unref(pipeline);
+			ok = TRUE;
+			goto done;
+		}
+		sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+		pad = gst_element_get_static_pad(sink, "sink");
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, bench_count_frame, &frames, NULL);
+
+		start_wall = g_get_monotonic_time();
+		start_cpu = bench_cpu_us();
+		start_allocs = allocations ? *allocations : 0;
+		gst_element_set_state(pipeline, GST_STATE_PLAYING);
+		bus = gst_element_get_bus(pipeline);
+		msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+		wall += g_get_monotonic_time() - start_wall;
+		cpu += bench_cpu_us() - start_cpu;
+		if (allocations) allocs += *allocations - start_allocs;
+		if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR)
+		{
+			GError *err = NULL;
+			gst_message_parse_error(msg, &err, NULL);
+			printf("%-8s failed, %s\n", bench->name, err->message);
+			g_error_free(err);
+			ok = FALSE;
+		}
+		else
+		{
+			ok = TRUE;
+		}
+		gst_message_unref(msg);
+		gst_object_unref(bus);
+		gst_element_set_state(pipeline, GST_STATE_NULL);
+		gst_object_unref(pad);
+		gst_object_unref(sink);
+		gst_object_unref(pipeline);
+		if (!ok) goto done;
+	}
+
+	if (!frames)
+	{
+		printf("%-8s no frames reached the sink\n", bench->name);
+		ok = FALSE;
+		goto done;
+	}
+	if (allocations)
+		printf("%-8s %10" G_GUINT64_FORMAT " %12.1f %12.2f %12.2f\n", bench->name, frames,
+			frames * (double)G_USEC_PER_SEC / MAX(wall, 1), cpu / (double)frames, allocs / (double)frames);
+	else
+		printf("%-8s %10" G_GUINT64_FORMAT " %12.1f %12.2f %12s\n", bench->name, frames,
+			frames * (double)G_USEC_PER_SEC / MAX(wall, 1), cpu / (double)frames, "-");
+
+done:
+	if (error) g_error_free(error);
+	g_free(description);
+	g_free(file);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	gint iterations = 1;
+	gchar **dirs = NULL;
+	GOptionEntry entries[] =
+	{
+		{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of times each sample is played", "N" },
+		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &dirs, NULL, "SAMPLEDIR" },
+		{ NULL }
+	};
+	GOptionContext *context;
+	GError *error = NULL;
+	gboolean ok = TRUE;
+	guint i;
+
+	context = g_option_context_new("- benchmark the dvb sinks");
+	g_option_context_set_summary(context,
+		"Plays sample.h264, sample.m2v, sample.aac, sample.wav and sample.dts from SAMPLEDIR,\n"
+		"where present, and reports per frame costs measured at the sink pad.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	g_option_context_add_group(context, gst_init_get_option_group());
+	if (!g_option_context_parse(context, &argc, &argv, &error) || !dirs || !dirs[0] || iterations < 1)
+	{
+		fprintf(stderr, "%s\n", error ? error->message : "usage: dvbbench [-n N] SAMPLEDIR");
+		return 1;
+	}
+	g_option_context_free(context);
+
+	/* exported by libfakedvb, missing when running against a real decoder */
+	allocations = dlsym(RTLD_DEFAULT, "fakedvb_allocations");
+	if (!allocations) fprintf(stderr, "libfakedvb is not preloaded, using the real decoder devices\n");
+
+	printf("%-8s %10s %12s %12s %12s\n", "stream", "frames", "frames/s", "cpu us/frame", "allocs/frame");
+	for (i = 0; i < G_N_ELEMENTS(cases); i++)
+	{
+		if (!bench_run(&cases[i], dirs[0], iterations)) ok = FALSE;
+	}
+	g_strfreev(dirs);
+	return ok ? 0 : 1;
+}
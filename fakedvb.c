@@ -0,0 +1,224 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * LD_PRELOAD shim for dvbbench: opening /dev/dvb/adapter<n>/video<n> or audio<n>
+ * returns an fd on /dev/null, which is always writable and reports an empty
+ * decoder buffer on POLLIN. The decoder ioctls succeed, the PTS queries follow
+ * the time since play, and malloc/calloc/realloc calls are counted.
+ * /proc/stb/audio/ac3 reads "downmix", so dtsdownmix can start.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/dvb/audio.h>
+#include <linux/dvb/video.h>
+
+#define FAKEDVB_MAX_FD 1024
+
+/* read by dvbbench through dlsym */
+volatile unsigned long fakedvb_allocations = 0;
+
+static unsigned char fake_fd[FAKEDVB_MAX_FD];
+static int64_t play_start[FAKEDVB_MAX_FD];
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__sync_fetch_and_add(&fakedvb_allocations, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	__sync_fetch_and_add(&fakedvb_allocations, 1);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&fakedvb_allocations, 1);
+	return __libc_realloc(ptr, size);
+}
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int is_decoder(const char *path)
+{
+	unsigned int adapter, index;
+	char type[8];
+	if (sscanf(path, "/dev/dvb/adapter%u/%7[a-z]%u", &adapter, type, &index) != 3) return 0;
+	return !strcmp(type, "video") || !strcmp(type, "audio");
+}
+
+static int fake_open(const char *path, int flags, mode_t mode, int (*real)(const char *, int, ...))
+{
+	int fd;
+	if (!is_decoder(path)) return real(path, flags, mode);
+	fd = real("/dev/null", O_RDWR | (flags & O_NONBLOCK));
+	if (fd >= 0 && fd < FAKEDVB_MAX_FD)
+	{
+		fake_fd[fd] = 1;
+		play_start[fd] = 0;
+	}
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	static int (*real)(const char *, int, ...) = NULL;
+	mode_t mode = 0;
+	if (!real) real = dlsym(RTLD_NEXT, "open");
+	if (flags & O_CREAT)
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+	return fake_open(path, flags, mode, real);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	static int (*real)(const char *, int, ...) = NULL;
+	mode_t mode = 0;
+	if (!real) real = dlsym(RTLD_NEXT, "open64");
+	if (flags & O_CREAT)
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+	return fake_open(path, flags, mode, real);
+}
+
+static FILE *fake_fopen(const char *path, const char *mode, FILE *(*real)(const char *, const char *))
+{
+	static char downmix[] = "downmix\n";
+	if (strcmp(path, "/proc/stb/audio/ac3")) return real(path, mode);
+	return fmemopen(downmix, sizeof(downmix) - 1, "r");
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+	static FILE *(*real)(const char *, const char *) = NULL;
+	if (!real) real = dlsym(RTLD_NEXT, "fopen");
+	return fake_fopen(path, mode, real);
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+	static FILE *(*real)(const char *, const char *) = NULL;
+	if (!real) real = dlsym(RTLD_NEXT, "fopen64");
+	return fake_fopen(path, mode, real);
+}
+
+int close(int fd)
+{
+	static int (*real)(int) = NULL;
+	if (!real) real = dlsym(RTLD_NEXT, "close");
+	if (fd >= 0 && fd < FAKEDVB_MAX_FD) fake_fd[fd] = 0;
+	return real(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*real)(int, unsigned long, ...) = NULL;
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (fd < 0 || fd >= FAKEDVB_MAX_FD || !fake_fd[fd])
+	{
+		if (!real) real = dlsym(RTLD_NEXT, "ioctl");
+		return real(fd, request, arg);
+	}
+
+	switch (request)
+	{
+	case VIDEO_PLAY:
+	case AUDIO_PLAY:
+		play_start[fd] = now_us();
+		break;
+	case VIDEO_STOP:
+	case AUDIO_STOP:
+		play_start[fd] = 0;
+		break;
+	case VIDEO_GET_PTS:
+#ifdef AUDIO_GET_PTS
+	/* only in the stb kernel headers */
+	case AUDIO_GET_PTS:
+#endif
+		/* 90 kHz since play */
+		*(int64_t *)arg = play_start[fd] ? (now_us() - play_start[fd]) * 9 / 100 : 0;
+		break;
+	case VIDEO_GET_EVENT:
+		errno = EAGAIN;
+		return -1;
+	default:
+		/* stream type, bypass mode, codec data, trick mode, ... just succeed */
+		break;
+	}
+	return 0;
+}
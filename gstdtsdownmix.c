@@ -65,13 +65,47 @@
 #define SAMPLE_TYPE GST_AUDIO_FORMAT_F32
 #endif
 
+/* s16-output produces stereo in the format the dvbaudiosink pcm path takes as is */
+#define DEFAULT_REQUEST_CHANNELS (DCA_CHANNEL | DCA_STEREO)
+#if SAMPLE_WIDTH == 16
+#define SRC_FORMATS SAMPLE_FORMAT
+#else
+#define SRC_FORMATS "{ " SAMPLE_FORMAT ", " GST_AUDIO_NE(S16) " }"
+#endif
+#if SAMPLE_WIDTH == 32
+/* with this bias libdca hands out floats whose mantissa holds the sample as 16 bit integer */
+#define S16_BIAS 384
+#define S16_BIAS_BITS 0x43c00000
+#else
+#define S16_BIAS 0
+#endif
+
+/* the interleave kernels only move 32 bit samples around */
+#if SAMPLE_WIDTH == 32
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_INTERLEAVE_SSE2 1
+#endif
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_INTERLEAVE_NEON 1
+#endif
+#endif
+
+#define DTS_SIMD_SSE2 (1 << 0)
+#define DTS_SIMD_NEON (1 << 1)
+
+/* blocks of 256 samples the output pool is sized for until a stream needs more */
+#define DTS_DEFAULT_POOL_BLOCKS 2
+
 GST_DEBUG_CATEGORY_STATIC (dtsdownmix_debug);
 #define GST_CAT_DEFAULT (dtsdownmix_debug)
 
 enum
 {
   PROP_0,
-  PROP_DRC
+  PROP_DRC,
+  PROP_S16_OUTPUT
 };
 
 static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
@@ -84,7 +118,7 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_SOMETIMES,
     GST_STATIC_CAPS ("audio/x-raw, "
-        "format = (string) " SAMPLE_FORMAT ", "
+        "format = (string) " SRC_FORMATS ", "
         "layout = (string) interleaved, "
         "rate = (int) [ 4000, 48000 ], " "channels = (int) [ 1, 6 ]")
     );
@@ -99,6 +133,8 @@ static gboolean gst_dtsdownmix_parse (GstAudioDecoder * dec, GstAdapter * adapte
     gint * offset, gint * length);
 static GstFlowReturn gst_dtsdownmix_handle_frame (GstAudioDecoder * dec,
     GstBuffer * buffer);
+static gboolean gst_dtsdownmix_decide_allocation (GstAudioDecoder * dec,
+    GstQuery * query);
 
 static GstFlowReturn gst_dtsdownmix_chain (GstPad * pad, GstObject * parent,
     GstBuffer * buf);
@@ -146,6 +182,7 @@ gst_dtsdownmix_class_init (GstDtsDecClass * klass)
   gstbase_class->set_format = GST_DEBUG_FUNCPTR (gst_dtsdownmix_set_format);
   gstbase_class->parse = GST_DEBUG_FUNCPTR (gst_dtsdownmix_parse);
   gstbase_class->handle_frame = GST_DEBUG_FUNCPTR (gst_dtsdownmix_handle_frame);
+  gstbase_class->decide_allocation = GST_DEBUG_FUNCPTR (gst_dtsdownmix_decide_allocation);
   parent_class = g_type_class_peek_parent(klass);
 
   /**
@@ -161,6 +198,12 @@ gst_dtsdownmix_class_init (GstDtsDecClass * klass)
           "Use Dynamic Range Compression", FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (G_OBJECT_CLASS (klass), PROP_S16_OUTPUT,
+      g_param_spec_boolean ("s16-output", "S16 output",
+          "Downmix straight to 16 bit stereo, so no converter is needed in front of the sink "
+          "(only while stopped)", FALSE,
+          G_PARAM_READWRITE | GST_PARAM_MUTABLE_READY | G_PARAM_STATIC_STRINGS));
+
   klass->dts_cpuflags = 0;
 
 #if HAVE_ORC
@@ -176,15 +219,37 @@ gst_dtsdownmix_class_init (GstDtsDecClass * klass)
   klass->dts_cpuflags = 0;
 #endif
 
-  GST_LOG ("CPU flags: dts=%08x, orc=%08x", klass->dts_cpuflags, cpuflags);
+  klass->simd_flags = 0;
+#ifdef HAVE_INTERLEAVE_SSE2
+  klass->simd_flags |= DTS_SIMD_SSE2;
+#endif
+#ifdef HAVE_INTERLEAVE_NEON
+  klass->simd_flags |= DTS_SIMD_NEON;
+#endif
+#if HAVE_ORC
+  /* the build may target more than the cpu we run on */
+  if (orc_target_get_by_name ("sse") && !(orc_target_get_default_flags
+          (orc_target_get_by_name ("sse")) & ORC_TARGET_SSE_SSE2))
+    klass->simd_flags &= ~DTS_SIMD_SSE2;
+  if (orc_target_get_by_name ("neon") && !(orc_target_get_default_flags
+          (orc_target_get_by_name ("neon")) & ORC_TARGET_NEON_NEON))
+    klass->simd_flags &= ~DTS_SIMD_NEON;
+#endif
+
+  GST_LOG ("CPU flags: dts=%08x, orc=%08x, simd=%08x", klass->dts_cpuflags,
+      cpuflags, klass->simd_flags);
 }
 
 static void
 gst_dtsdownmix_init (GstDtsDec * dtsdownmix)
 {
-  dtsdownmix->request_channels = DCA_CHANNEL | DCA_STEREO;
+  dtsdownmix->request_channels = DEFAULT_REQUEST_CHANNELS;
   dtsdownmix->dynamic_range_compression = FALSE;
+  dtsdownmix->s16_output = FALSE;
   dtsdownmix->stream_started = 0;
+  dtsdownmix->pool = NULL;
+  dtsdownmix->pool_size = 0;
+  dtsdownmix->pool_blocks = DTS_DEFAULT_POOL_BLOCKS;
   GST_INFO_OBJECT(dtsdownmix, "DTSDOWNMIX_INIT");
   /* retrieve and intercept base class chain.
    * Quite HACKish, but that's dvd specs for you,
@@ -224,6 +289,12 @@ static gboolean gst_dtsdownmix_start (GstAudioDecoder * dec)
 	dts->level = 1;
 	dts->bias = 0;
 	dts->flag_update = TRUE;
+	dts->request_channels = DEFAULT_REQUEST_CHANNELS;
+	if (dts->s16_output)
+	{
+		dts->request_channels = DCA_STEREO;
+		dts->bias = S16_BIAS;
+	}
 
 	/* call upon legacy upstream byte support (e.g. seeking) */
 	gst_audio_decoder_set_estimate_rate (dec, TRUE);
@@ -251,6 +322,13 @@ gst_dtsdownmix_stop (GstAudioDecoder * dec)
     dca_free (dts->state);
     dts->state = NULL;
   }
+  if (dts->pool) {
+    gst_buffer_pool_set_active (dts->pool, FALSE);
+    gst_object_unref (dts->pool);
+    dts->pool = NULL;
+  }
+  dts->pool_size = 0;
+  dts->pool_blocks = DTS_DEFAULT_POOL_BLOCKS;
   return TRUE;
 }
 
@@ -416,7 +494,8 @@ gst_dtsdownmix_renegotiate (GstDtsDec * dts)
 
   gst_audio_info_init (&info);
   gst_audio_info_set_format (&info,
-      SAMPLE_TYPE, dts->sample_rate, channels, (channels > 1 ? to : NULL));
+      dts->s16_output ? GST_AUDIO_FORMAT_S16 : SAMPLE_TYPE, dts->sample_rate,
+      channels, (channels > 1 ? to : NULL));
 
   if (!gst_audio_decoder_set_output_format (GST_AUDIO_DECODER (dts), &info))
     goto done;
@@ -442,6 +521,302 @@ gst_dtsdownmix_update_streaminfo (GstDtsDec * dts)
   }
 }
 
+static gint
+gst_dtsdownmix_sample_bytes (GstDtsDec * dts)
+{
+  return dts->s16_output ? 2 : SAMPLE_WIDTH / 8;
+}
+
+/* keep a pool of output buffers sized for the negotiated channels */
+static gboolean
+gst_dtsdownmix_decide_allocation (GstAudioDecoder * bdec, GstQuery * query)
+{
+  GstDtsDec *dts = GST_DTSDOWNMIX (bdec);
+  GstBufferPool *pool = NULL;
+  GstStructure *config;
+  GstCaps *caps;
+  guint size = 0, min = 0, max = 0;
+  gint channels;
+
+  if (!GST_AUDIO_DECODER_CLASS (parent_class)->decide_allocation (bdec, query))
+    return FALSE;
+
+  if (dts->pool) {
+    gst_buffer_pool_set_active (dts->pool, FALSE);
+    gst_object_unref (dts->pool);
+    dts->pool = NULL;
+  }
+  dts->pool_size = 0;
+
+  channels = gst_dtsdownmix_channels (dts->using_channels, NULL);
+  if (channels <= 0)
+    return TRUE;
+
+  gst_query_parse_allocation (query, &caps, NULL);
+  if (gst_query_get_n_allocation_pools (query) > 0)
+    gst_query_parse_nth_allocation_pool (query, 0, &pool, &size, &min, &max);
+  if (!pool)
+    pool = gst_buffer_pool_new ();
+
+  size = MAX (size, 256 * channels * gst_dtsdownmix_sample_bytes (dts) * dts->pool_blocks);
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_set_params (config, caps, size, MAX (min, 2), max);
+  if (!gst_buffer_pool_set_config (pool, config)
+      || !gst_buffer_pool_set_active (pool, TRUE)) {
+    GST_WARNING_OBJECT (dts, "cannot configure output pool, falling back to plain allocation");
+    gst_object_unref (pool);
+    return TRUE;
+  }
+
+  GST_DEBUG_OBJECT (dts, "output pool of %u byte buffers for %d channels, %d blocks",
+      size, channels, dts->pool_blocks);
+  dts->pool = pool;
+  dts->pool_size = size;
+  return TRUE;
+}
+
+/* interleave one block of 256 planar samples per channel */
+static void
+gst_dtsdownmix_interleave_scalar (sample_t * out, const sample_t * in,
+    const gint * reorder_map, gint chans)
+{
+  gint n, c;
+
+  for (n = 0; n < 256; n++) {
+    for (c = 0; c < chans; c++) {
+      out[n * chans + reorder_map[c]] = in[c * 256 + n];
+    }
+  }
+}
+
+#ifdef HAVE_INTERLEAVE_SSE2
+static void
+gst_dtsdownmix_interleave_2_sse2 (sample_t * out, const sample_t ** src)
+{
+  gint n;
+
+  for (n = 0; n < 256; n += 4) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (src[0] + n));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (src[1] + n));
+    _mm_storeu_si128 ((__m128i *) (out + 2 * n), _mm_unpacklo_epi32 (a, b));
+    _mm_storeu_si128 ((__m128i *) (out + 2 * n + 4), _mm_unpackhi_epi32 (a, b));
+  }
+}
+
+static void
+gst_dtsdownmix_interleave_6_sse2 (sample_t * out, const sample_t ** src)
+{
+  gint n;
+
+  for (n = 0; n < 256; n += 4) {
+    __m128i p0 = _mm_loadu_si128 ((const __m128i *) (src[0] + n));
+    __m128i p1 = _mm_loadu_si128 ((const __m128i *) (src[1] + n));
+    __m128i p2 = _mm_loadu_si128 ((const __m128i *) (src[2] + n));
+    __m128i p3 = _mm_loadu_si128 ((const __m128i *) (src[3] + n));
+    __m128i p4 = _mm_loadu_si128 ((const __m128i *) (src[4] + n));
+    __m128i p5 = _mm_loadu_si128 ((const __m128i *) (src[5] + n));
+    /* transpose the first four channels, pair up the last two */
+    __m128i t0 = _mm_unpacklo_epi32 (p0, p1);
+    __m128i t1 = _mm_unpacklo_epi32 (p2, p3);
+    __m128i t2 = _mm_unpackhi_epi32 (p0, p1);
+    __m128i t3 = _mm_unpackhi_epi32 (p2, p3);
+    __m128i r0 = _mm_unpacklo_epi64 (t0, t1);
+    __m128i r1 = _mm_unpackhi_epi64 (t0, t1);
+    __m128i r2 = _mm_unpacklo_epi64 (t2, t3);
+    __m128i r3 = _mm_unpackhi_epi64 (t2, t3);
+    __m128i lo = _mm_unpacklo_epi32 (p4, p5);
+    __m128i hi = _mm_unpackhi_epi32 (p4, p5);
+    __m128i *dst = (__m128i *) (out + 6 * n);
+    _mm_storeu_si128 (dst + 0, r0);
+    _mm_storeu_si128 (dst + 1, _mm_unpacklo_epi64 (lo, r1));
+    _mm_storeu_si128 (dst + 2, _mm_unpackhi_epi64 (r1, lo));
+    _mm_storeu_si128 (dst + 3, r2);
+    _mm_storeu_si128 (dst + 4, _mm_unpacklo_epi64 (hi, r3));
+    _mm_storeu_si128 (dst + 5, _mm_unpackhi_epi64 (r3, hi));
+  }
+}
+#endif
+
+#ifdef HAVE_INTERLEAVE_NEON
+static void
+gst_dtsdownmix_interleave_2_neon (sample_t * out, const sample_t ** src)
+{
+  gint n;
+
+  for (n = 0; n < 256; n += 4) {
+    uint32x4x2_t v;
+    v.val[0] = vld1q_u32 ((const uint32_t *) (src[0] + n));
+    v.val[1] = vld1q_u32 ((const uint32_t *) (src[1] + n));
+    vst2q_u32 ((uint32_t *) (out + 2 * n), v);
+  }
+}
+
+static void
+gst_dtsdownmix_interleave_6_neon (sample_t * out, const sample_t ** src)
+{
+  gint n;
+
+  for (n = 0; n < 256; n += 4) {
+    uint32x4_t p0 = vld1q_u32 ((const uint32_t *) (src[0] + n));
+    uint32x4_t p1 = vld1q_u32 ((const uint32_t *) (src[1] + n));
+    uint32x4_t p2 = vld1q_u32 ((const uint32_t *) (src[2] + n));
+    uint32x4_t p3 = vld1q_u32 ((const uint32_t *) (src[3] + n));
+    uint32x4_t p4 = vld1q_u32 ((const uint32_t *) (src[4] + n));
+    uint32x4_t p5 = vld1q_u32 ((const uint32_t *) (src[5] + n));
+    /* transpose the first four channels, pair up the last two */
+    uint32x4x2_t z02 = vzipq_u32 (p0, p2);
+    uint32x4x2_t z13 = vzipq_u32 (p1, p3);
+    uint32x4x2_t r01 = vzipq_u32 (z02.val[0], z13.val[0]);
+    uint32x4x2_t r23 = vzipq_u32 (z02.val[1], z13.val[1]);
+    uint32x4x2_t z45 = vzipq_u32 (p4, p5);
+    uint32_t *dst = (uint32_t *) (out + 6 * n);
+    vst1q_u32 (dst, r01.val[0]);
+    vst1q_u32 (dst + 4, vcombine_u32 (vget_low_u32 (z45.val[0]),
+            vget_low_u32 (r01.val[1])));
+    vst1q_u32 (dst + 8, vcombine_u32 (vget_high_u32 (r01.val[1]),
+            vget_high_u32 (z45.val[0])));
+    vst1q_u32 (dst + 12, r23.val[0]);
+    vst1q_u32 (dst + 16, vcombine_u32 (vget_low_u32 (z45.val[1]),
+            vget_low_u32 (r23.val[1])));
+    vst1q_u32 (dst + 20, vcombine_u32 (vget_high_u32 (r23.val[1]),
+            vget_high_u32 (z45.val[1])));
+  }
+}
+#endif
+
+static void
+gst_dtsdownmix_interleave (GstDtsDec * dts, guint32 simd_flags,
+    sample_t * out, gint chans)
+{
+#if defined(HAVE_INTERLEAVE_SSE2) || defined(HAVE_INTERLEAVE_NEON)
+  if (chans == 2 || chans == 6) {
+    const sample_t *src[6];
+    gint c;
+
+    /* the kernels write the channels in order, so reorder the planes */
+    for (c = 0; c < chans; c++)
+      src[dts->channel_reorder_map[c]] = dts->samples + c * 256;
+#ifdef HAVE_INTERLEAVE_NEON
+    if (simd_flags & DTS_SIMD_NEON) {
+      if (chans == 2)
+        gst_dtsdownmix_interleave_2_neon (out, src);
+      else
+        gst_dtsdownmix_interleave_6_neon (out, src);
+      return;
+    }
+#endif
+#ifdef HAVE_INTERLEAVE_SSE2
+    if (simd_flags & DTS_SIMD_SSE2) {
+      if (chans == 2)
+        gst_dtsdownmix_interleave_2_sse2 (out, src);
+      else
+        gst_dtsdownmix_interleave_6_sse2 (out, src);
+      return;
+    }
+#endif
+  }
+#endif
+  gst_dtsdownmix_interleave_scalar (out, dts->samples,
+      dts->channel_reorder_map, chans);
+}
+
+/* the fixed point libdca already puts out s16, only the float builds quantize */
+#if SAMPLE_WIDTH != 16
+/* interleave and quantize one block in a single pass */
+static inline gint16
+gst_dtsdownmix_to_s16 (sample_t sample)
+{
+#if SAMPLE_WIDTH == 32
+  union { sample_t f; gint32 i; } u;
+
+  u.f = sample;
+  if (u.i > S16_BIAS_BITS + 32767)
+    return 32767;
+  if (u.i < S16_BIAS_BITS - 32768)
+    return -32768;
+  return u.i - S16_BIAS_BITS;
+#else
+  gint32 i = (gint32) (sample * 32768 + (sample < 0 ? -0.5 : 0.5));
+
+  return CLAMP (i, -32768, 32767);
+#endif
+}
+
+static void
+gst_dtsdownmix_interleave_s16_scalar (gint16 * out, const sample_t * in,
+    const gint * reorder_map, gint chans)
+{
+  gint n, c;
+
+  for (n = 0; n < 256; n++) {
+    for (c = 0; c < chans; c++) {
+      out[n * chans + reorder_map[c]] = gst_dtsdownmix_to_s16 (in[c * 256 + n]);
+    }
+  }
+}
+
+#ifdef HAVE_INTERLEAVE_SSE2
+/* the biased float bits are monotonic, so the saturating pack does the clipping */
+static void
+gst_dtsdownmix_interleave_s16_2_sse2 (gint16 * out, const sample_t ** src)
+{
+  const __m128i bias = _mm_set1_epi32 (S16_BIAS_BITS);
+  gint n;
+
+  for (n = 0; n < 256; n += 4) {
+    __m128i a = _mm_sub_epi32 (_mm_loadu_si128 ((const __m128i *) (src[0] + n)), bias);
+    __m128i b = _mm_sub_epi32 (_mm_loadu_si128 ((const __m128i *) (src[1] + n)), bias);
+    _mm_storeu_si128 ((__m128i *) (out + 2 * n),
+        _mm_packs_epi32 (_mm_unpacklo_epi32 (a, b), _mm_unpackhi_epi32 (a, b)));
+  }
+}
+#endif
+
+#ifdef HAVE_INTERLEAVE_NEON
+static void
+gst_dtsdownmix_interleave_s16_2_neon (gint16 * out, const sample_t ** src)
+{
+  const int32x4_t bias = vdupq_n_s32 (S16_BIAS_BITS);
+  gint n;
+
+  for (n = 0; n < 256; n += 4) {
+    int16x4x2_t v;
+    v.val[0] = vqmovn_s32 (vsubq_s32 (vld1q_s32 ((const int32_t *) (src[0] + n)), bias));
+    v.val[1] = vqmovn_s32 (vsubq_s32 (vld1q_s32 ((const int32_t *) (src[1] + n)), bias));
+    vst2_s16 ((int16_t *) (out + 2 * n), v);
+  }
+}
+#endif
+
+static void
+gst_dtsdownmix_interleave_s16 (GstDtsDec * dts, guint32 simd_flags,
+    gint16 * out, gint chans)
+{
+#if defined(HAVE_INTERLEAVE_SSE2) || defined(HAVE_INTERLEAVE_NEON)
+  if (chans == 2) {
+    const sample_t *src[2];
+
+    src[dts->channel_reorder_map[0]] = dts->samples;
+    src[dts->channel_reorder_map[1]] = dts->samples + 256;
+#ifdef HAVE_INTERLEAVE_NEON
+    if (simd_flags & DTS_SIMD_NEON) {
+      gst_dtsdownmix_interleave_s16_2_neon (out, src);
+      return;
+    }
+#endif
+#ifdef HAVE_INTERLEAVE_SSE2
+    if (simd_flags & DTS_SIMD_SSE2) {
+      gst_dtsdownmix_interleave_s16_2_sse2 (out, src);
+      return;
+    }
+#endif
+  }
+#endif
+  gst_dtsdownmix_interleave_s16_scalar (out, dts->samples,
+      dts->channel_reorder_map, chans);
+}
+#endif
+
 static GstFlowReturn
 gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
 {
@@ -455,8 +830,10 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
   gint length = 0, flags, sample_rate, bit_rate, frame_length;
   GstFlowReturn result = GST_FLOW_OK;
   GstBuffer *outbuf;
+  guint32 simd_flags;
   
   dts = GST_DTSDOWNMIX (bdec);
+  simd_flags = GST_DTSDOWNMIX_CLASS (G_OBJECT_GET_CLASS (dts))->simd_flags;
 
   /* no fancy draining */
   if (G_UNLIKELY (!buffer))
@@ -583,8 +960,20 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
 
   /* handle decoded data, one block is 256 samples */
   num_blocks = dca_blocks_num (dts->state);
-  outbuf =
-      gst_buffer_new_and_alloc (256 * chans * (SAMPLE_WIDTH / 8) * num_blocks);
+  size = 256 * chans * gst_dtsdownmix_sample_bytes (dts) * num_blocks;
+  outbuf = NULL;
+  if (dts->pool && size <= dts->pool_size) {
+    if (gst_buffer_pool_acquire_buffer (dts->pool, &outbuf, NULL) == GST_FLOW_OK)
+      gst_buffer_set_size (outbuf, size);
+    else
+      outbuf = NULL;
+  } else if (dts->pool && num_blocks > dts->pool_blocks) {
+    /* larger frames than the pool was sized for, have it reallocated */
+    dts->pool_blocks = num_blocks;
+    gst_pad_mark_reconfigure (GST_AUDIO_DECODER_SRC_PAD (bdec));
+  }
+  if (!outbuf)
+    outbuf = gst_audio_decoder_allocate_output_buffer (bdec, size);
 
   gst_buffer_map (outbuf, &map, GST_MAP_WRITE);
   data = map.data;
@@ -599,17 +988,14 @@ gst_dtsdownmix_handle_frame (GstAudioDecoder * bdec, GstBuffer * buffer)
         if (result != GST_FLOW_OK)
           goto exit;
       } else {
-        gint n, c;
-        gint *reorder_map = dts->channel_reorder_map;
-
-        for (n = 0; n < 256; n++) {
-          for (c = 0; c < chans; c++) {
-            ((sample_t *) ptr)[n * chans + reorder_map[c]] =
-                dts->samples[c * 256 + n];
-          }
-        }
+#if SAMPLE_WIDTH != 16
+        if (dts->s16_output)
+          gst_dtsdownmix_interleave_s16 (dts, simd_flags, (gint16 *) ptr, chans);
+        else
+#endif
+          gst_dtsdownmix_interleave (dts, simd_flags, (sample_t *) ptr, chans);
       }
-      ptr += 256 * chans * (SAMPLE_WIDTH / 8);
+      ptr += 256 * chans * gst_dtsdownmix_sample_bytes (dts);
     }
   }
   gst_buffer_unmap (outbuf, &map);
@@ -745,6 +1131,13 @@ gst_dtsdownmix_set_property (GObject * object, guint prop_id, const GValue * val
     case PROP_DRC:
       dts->dynamic_range_compression = g_value_get_boolean (value);
       break;
+    case PROP_S16_OUTPUT:
+      /* start picks the output format, it cannot change under a running decoder */
+      if (dts->state)
+        GST_WARNING_OBJECT (dts, "s16-output can only be changed while stopped");
+      else
+        dts->s16_output = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -761,6 +1154,9 @@ gst_dtsdownmix_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_DRC:
       g_value_set_boolean (value, dts->dynamic_range_compression);
       break;
+    case PROP_S16_OUTPUT:
+      g_value_set_boolean (value, dts->s16_output);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -914,7 +1310,6 @@ static GstStateChangeReturn gst_dtsdownmix_change_state(GstElement * element, Gs
 	GstAudioDecoder *dec = GST_AUDIO_DECODER(element);
 	GstDtsDecClass *klass;
 	klass = GST_DTSDOWNMIX_CLASS (G_OBJECT_GET_CLASS (dts));
-	FILE *f;
 	
 	switch (transition) 
 	{
@@ -925,12 +1320,7 @@ static GstStateChangeReturn gst_dtsdownmix_change_state(GstElement * element, Gs
 				dts->state = NULL;
 				return GST_STATE_CHANGE_FAILURE;
 			}
-			f = fopen("/tmp/dtsdownmix", "w");
-			if (f)
-			{
-				fprintf(f,"READY\n");
-				fclose(f);
-			}
+			set_downmix_ready(element, TRUE);
 			break;
 		case GST_STATE_CHANGE_READY_TO_PAUSED:
 			GST_INFO_OBJECT(dts, "GST_STATE_CHANGE_READY_TO_PAUSED");
@@ -954,12 +1344,7 @@ static GstStateChangeReturn gst_dtsdownmix_change_state(GstElement * element, Gs
 			break;
 		case GST_STATE_CHANGE_READY_TO_NULL:
 			GST_INFO_OBJECT(dts, "GST_STATE_CHANGE_READY_TO_NULL Nr %d", transition);
-			f = fopen("/tmp/dtsdownmix", "w");
-			if (f)
-			{
-				fprintf(f,"NONE\n");
-				fclose(f);
-			}
+			set_downmix_ready(element, FALSE);
 			break;
 		default:
 			break;
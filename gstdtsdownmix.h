@@ -71,14 +71,21 @@ struct _GstDtsDec {
 	sample_t 	 level;
 	sample_t 	 bias;
 	gboolean 	 dynamic_range_compression;
+	gboolean	 s16_output; /* property, only changed while stopped */
 	sample_t 	*samples;
 	dca_state_t   *state;
+
+	/* output buffers, sized for pool_blocks blocks */
+	GstBufferPool	*pool;
+	gsize		 pool_size;
+	gint		 pool_blocks;
 };
 
 struct _GstDtsDecClass {
   GstAudioDecoderClass parent_class;
 
   guint32 dts_cpuflags;
+  guint32 simd_flags; /* interleave kernels usable on this cpu */
 };
 
 GType gst_dtsdownmix_get_type(void);
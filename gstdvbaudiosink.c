@@ -67,9 +67,11 @@
 #include <gst/gst.h>
 #include <gst/audio/audio.h>
 #include <gst/base/gstbasesink.h>
+#include <gst/base/gstadapter.h>
 #include <gst/audio/gstaudiodecoder.h>
 
 #include "common.h"
+#include "gstdvbclock.h"
 #include "gstdvbaudiosink.h"
 #include "gstdvbsink-marshal.h"
 
@@ -82,6 +84,49 @@ enum
 	LAST_SIGNAL
 };
 
+enum
+{
+	PROP_0,
+	PROP_QUEUE_ENTRIES,
+	PROP_QUEUE_BYTES,
+	PROP_RESUME_TIMEOUT,
+	PROP_FAST_ZAP,
+	PROP_WRITER_THREAD,
+	PROP_RING_SIZE,
+	PROP_RING_BYTES,
+	PROP_RING_TIME,
+	PROP_PROVIDE_CLOCK,
+	PROP_POSITION_WINDOW,
+	PROP_POSITION_HITS,
+	PROP_POSITION_MISSES,
+	PROP_AGGREGATE_LATENCY,
+	PROP_ADAPTER,
+	PROP_STATS,
+	PROP_BUFFER_DEPTH,
+	PROP_DEPTH_INTERVAL,
+	PROP_LIVE_LATENCY,
+	PROP_LIVE_DROPPED,
+	PROP_FAST_EOS,
+	PROP_GAPLESS,
+	PROP_DECODER,
+	PROP_DEVICE,
+	PROP_VIDEO_DEVICE,
+};
+
+#define DEFAULT_RESUME_TIMEOUT 1000
+#define DEFAULT_PROVIDE_CLOCK FALSE
+#define DEFAULT_POSITION_WINDOW 20
+#define DEFAULT_AGGREGATE_LATENCY 0
+#define DEFAULT_ADAPTER 0
+/* buffers of a proposed pool, large enough for most frames */
+#define POOL_BUFFER_SIZE (64 * 1024)
+#define DEFAULT_DECODER 0
+#define DEFAULT_BUFFER_DEPTH 0
+#define DEFAULT_DEPTH_INTERVAL 0
+#define DEFAULT_LIVE_LATENCY 0
+#define DEFAULT_FAST_EOS FALSE
+#define DEFAULT_GAPLESS FALSE
+
 static guint gst_dvbaudiosink_signals[LAST_SIGNAL] = { 0 };
 
 
@@ -184,6 +229,8 @@ GST_STATIC_PAD_TEMPLATE(
 static void gst_dvbaudiosink_init(GstDVBAudioSink *self);
 static void gst_dvbaudiosink_dispose(GObject *obj);
 static void gst_dvbaudiosink_reset(GObject *obj);
+static void gst_dvbaudiosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_dvbaudiosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
 
 #define DEBUG_INIT \
 	GST_DEBUG_CATEGORY_INIT(dvbaudiosink_debug, "dvbaudiosink", 0, "dvbaudiosink element");
@@ -198,9 +245,16 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink * sink, GstBuffer * buf
 static gboolean gst_dvbaudiosink_unlock(GstBaseSink * basesink);
 static gboolean gst_dvbaudiosink_unlock_stop(GstBaseSink * basesink);
 static gboolean gst_dvbaudiosink_set_caps(GstBaseSink * sink, GstCaps * caps);
+static gboolean gst_dvbaudiosink_propose_allocation(GstBaseSink *sink, GstQuery *query);
 static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink, GstCaps *filter);
 static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement * element, GstStateChange transition);
+static GstClock *gst_dvbaudiosink_provide_clock(GstElement * element);
 static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self);
+static GstClockTime gst_dvbaudiosink_sample_decoder_time(GstClock *clock, gpointer user_data);
+static gboolean gst_dvbaudiosink_ring_cancel(gpointer data);
+static int gst_dvbaudiosink_flush_aggregate(GstDVBAudioSink *self);
+static void gst_dvbaudiosink_discard_aggregate(GstDVBAudioSink *self);
+static void gst_dvbaudiosink_select_codec(GstDVBAudioSink *self);
 
 /* initialize the plugin's class */
 static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
@@ -213,6 +267,8 @@ static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
 
 	gobject_class->finalize = gst_dvbaudiosink_reset;
 	gobject_class->dispose = gst_dvbaudiosink_dispose;
+	gobject_class->set_property = gst_dvbaudiosink_set_property;
+	gobject_class->get_property = gst_dvbaudiosink_get_property;
 
 	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&sink_factory));
 	gst_element_class_set_static_metadata(element_class,
@@ -228,9 +284,131 @@ static void gst_dvbaudiosink_class_init(GstDVBAudioSinkClass *self)
 	gstbasesink_class->unlock = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_unlock);
 	gstbasesink_class->unlock_stop = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_unlock_stop);
 	gstbasesink_class->set_caps = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_set_caps);
+	gstbasesink_class->propose_allocation = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_propose_allocation);
 	gstbasesink_class->get_caps = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_get_caps);
 
 	element_class->change_state = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_change_state);
+	element_class->provide_clock = GST_DEBUG_FUNCPTR(gst_dvbaudiosink_provide_clock);
+
+	g_object_class_install_property(gobject_class, PROP_QUEUE_ENTRIES,
+		g_param_spec_uint("queue-entries", "Queue entries",
+		"Number of buffer ranges waiting to be written to the decoder",
+		0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_QUEUE_BYTES,
+		g_param_spec_uint64("queue-bytes", "Queue bytes",
+		"Number of bytes waiting to be written to the decoder",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RESUME_TIMEOUT,
+		g_param_spec_uint("resume-timeout", "Resume timeout",
+		"Maximum time in ms to wait for the decoder before rendering resumes after a flush",
+		0, G_MAXUINT, DEFAULT_RESUME_TIMEOUT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_FAST_ZAP,
+		g_param_spec_boolean("fast-zap", "Fast zap",
+		"Keep the decoder running on caps changes which do not change the decoder setup",
+		FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_WRITER_THREAD,
+		g_param_spec_boolean("writer-thread", "Writer thread",
+		"Write to the decoder from a separate thread (takes effect on the next start)",
+		FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RING_SIZE,
+		g_param_spec_uint("ring-size", "Ring size",
+		"Number of packets the writer thread ring can hold (takes effect on the next start)",
+		1, 1024, PES_RING_DEFAULT_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RING_BYTES,
+		g_param_spec_uint64("ring-bytes", "Ring bytes",
+		"Number of bytes waiting in the writer thread ring",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RING_TIME,
+		g_param_spec_uint64("ring-time", "Ring time",
+		"Duration of the data waiting in the writer thread ring",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_PROVIDE_CLOCK,
+		g_param_spec_boolean("provide-clock", "Provide clock",
+		"Provide a clock driven by the decoder to the pipeline",
+		DEFAULT_PROVIDE_CLOCK, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POSITION_WINDOW,
+		g_param_spec_uint("position-window", "Position window",
+		"Time in ms a decoder position sample is reused before the decoder is asked again (0 = always ask)",
+		0, 1000, DEFAULT_POSITION_WINDOW, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POSITION_HITS,
+		g_param_spec_uint64("position-hits", "Position hits",
+		"Number of decoder position requests served from the cached sample",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POSITION_MISSES,
+		g_param_spec_uint64("position-misses", "Position misses",
+		"Number of decoder position requests which had to ask the decoder",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_AGGREGATE_LATENCY,
+		g_param_spec_uint("aggregate-latency", "Aggregate latency",
+		"Pack consecutive AC3, MPEG and ADTS AAC frames into one PES packet, up to this many ms of audio (0 = off)",
+		0, 1000, DEFAULT_AGGREGATE_LATENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_ADAPTER,
+		g_param_spec_uint("adapter", "Adapter",
+		"DVB adapter number of the audio decoder (takes effect on the next start)",
+		0, 255, DEFAULT_ADAPTER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_DECODER,
+		g_param_spec_uint("decoder", "Decoder",
+		"Index of the audio decoder on the adapter, for boxes with more than one (takes effect on the next start)",
+		0, 255, DEFAULT_DECODER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_DEVICE,
+		g_param_spec_string("device", "Device",
+		"Audio decoder device node, overrides adapter and decoder when set (takes effect on the next start)",
+		NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_VIDEO_DEVICE,
+		g_param_spec_string("video-device", "Video device",
+		"Video decoder device node which follows the playback rate, overrides adapter and decoder when set",
+		NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_STATS,
+		g_param_spec_boxed("stats", "Statistics",
+		"Counters and histograms of the writes to the audio decoder since the last start",
+		GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_BUFFER_DEPTH,
+		g_param_spec_uint("buffer-depth", "Buffer depth",
+		"Hold back upstream while more than this many ms are written ahead of the decoder position (0 = fill the decoder fifo)",
+		0, 60000, DEFAULT_BUFFER_DEPTH, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_DEPTH_INTERVAL,
+		g_param_spec_uint("depth-interval", "Depth interval",
+		"Post a bufferDepth element message at most every this many ms while rendering (0 = never)",
+		0, 60000, DEFAULT_DEPTH_INTERVAL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_LIVE_LATENCY,
+		g_param_spec_uint("live-latency", "Live latency",
+		"Drop frames while more than this many ms are written ahead of the decoder position (0 = never drop)",
+		0, 60000, DEFAULT_LIVE_LATENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_LIVE_DROPPED,
+		g_param_spec_uint64("live-dropped", "Live dropped",
+		"Number of frames dropped to keep the live latency",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_FAST_EOS,
+		g_param_spec_boolean("fast-eos", "Fast EOS",
+		"Finish EOS once the decoder position reaches the last written pts, without waiting for the driver to report an empty buffer",
+		DEFAULT_FAST_EOS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_GAPLESS,
+		g_param_spec_boolean("gapless", "Gapless",
+		"Keep the decoder open and running between streams, it is only stopped when the codec changes",
+		DEFAULT_GAPLESS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
 	gst_dvbaudiosink_signals[SIGNAL_GET_DECODER_TIME] =
 		g_signal_new("get-decoder-time",
@@ -251,21 +429,47 @@ static void gst_dvbaudiosink_init(GstDVBAudioSink *self)
 {
 	self->codec_data = NULL;
 	self->bypass = AUDIOTYPE_UNKNOWN;
+	self->audio_codec = NULL;
 	self->fixed_buffersize = 0;
 	self->fixed_bufferduration = GST_CLOCK_TIME_NONE;
 	self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
 	self->aac_adts_header_valid = FALSE;
-	self->pesheader_buffer = NULL;
-	self->cache = NULL;
+	self->pesheader.buffer = NULL;
+	self->adapter = gst_adapter_new();
 	self->playing = self->flushing = self->unlocking = self->paused = FALSE;
 	self->pts_written = self->using_dts_downmix = FALSE;
 	self->lastpts = 0;
 	self->timestamp_offset = 0;
-	self->queue = NULL;
+	queue_init(&self->queue);
+	self->resume_timeout = DEFAULT_RESUME_TIMEOUT;
+	self->fast_zap = FALSE;
+	self->writer_thread = FALSE;
+	self->ring_size = PES_RING_DEFAULT_SIZE;
+	memset(&self->ring, 0, sizeof(self->ring));
+	self->writer_error = 0;
+	self->dvb_adapter = DEFAULT_ADAPTER;
+	self->dvb_decoder = DEFAULT_DECODER;
+	self->dvb_device = NULL;
+	self->dvb_video_device = NULL;
+	self->buffer_depth = DEFAULT_BUFFER_DEPTH;
+	self->depth_interval = DEFAULT_DEPTH_INTERVAL;
+	self->live_latency = DEFAULT_LIVE_LATENCY;
+	self->live_dropped = 0;
+	self->fast_eos = DEFAULT_FAST_EOS;
+	self->gapless = DEFAULT_GAPLESS;
+	self->gapless_kept = FALSE;
+	self->written_position = self->written_pts = -1;
+	self->depth_reported = 0;
 	self->fd = -1;
 	self->unlockfd[0] = self->unlockfd[1] = -1;
 	self->rate = 1.0;
 	self->timestamp = GST_CLOCK_TIME_NONE;
+	self->aggregate_latency = DEFAULT_AGGREGATE_LATENCY;
+	memset(self->aggregate_unit, 0, sizeof(self->aggregate_unit));
+	self->aggregate_count = 0;
+	self->clock = gst_dvbclock_new("GstDVBAudioSinkClock", gst_dvbaudiosink_sample_decoder_time, self);
+	self->provide_clock = DEFAULT_PROVIDE_CLOCK;
+	if (self->provide_clock) GST_OBJECT_FLAG_SET(self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
 
 	gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
 	gst_base_sink_set_async_enabled(GST_BASE_SINK(self), TRUE);
@@ -279,12 +483,184 @@ static void gst_dvbaudiosink_dispose(GObject *obj)
 
 static void gst_dvbaudiosink_reset(GObject *obj)
 {
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(obj);
+	queue_free(&self->queue);
+	g_object_unref(self->adapter);
+	gst_dvbclock_invalidate(GST_DVBCLOCK(self->clock));
+	gst_object_unref(self->clock);
+	g_free(self->dvb_device);
+	g_free(self->dvb_video_device);
 	G_OBJECT_CLASS(parent_class)->finalize(obj);
 	GST_INFO("GstDVBAudioSink RESET");
 }
 
-static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self)
+static void gst_dvbaudiosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
 {
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_RESUME_TIMEOUT:
+		self->resume_timeout = g_value_get_uint(value);
+		break;
+	case PROP_FAST_ZAP:
+		self->fast_zap = g_value_get_boolean(value);
+		break;
+	case PROP_WRITER_THREAD:
+		self->writer_thread = g_value_get_boolean(value);
+		break;
+	case PROP_RING_SIZE:
+		self->ring_size = g_value_get_uint(value);
+		break;
+	case PROP_PROVIDE_CLOCK:
+		GST_OBJECT_LOCK(self);
+		self->provide_clock = g_value_get_boolean(value);
+		if (self->provide_clock)
+			GST_OBJECT_FLAG_SET(self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
+		else
+			GST_OBJECT_FLAG_UNSET(self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_POSITION_WINDOW:
+		gst_dvbclock_set_interval(GST_DVBCLOCK(self->clock), g_value_get_uint(value) * GST_MSECOND);
+		break;
+	case PROP_AGGREGATE_LATENCY:
+		self->aggregate_latency = g_value_get_uint(value);
+		break;
+	case PROP_ADAPTER:
+		self->dvb_adapter = g_value_get_uint(value);
+		break;
+	case PROP_DECODER:
+		self->dvb_decoder = g_value_get_uint(value);
+		break;
+	case PROP_DEVICE:
+		g_free(self->dvb_device);
+		self->dvb_device = g_value_dup_string(value);
+		break;
+	case PROP_VIDEO_DEVICE:
+		g_free(self->dvb_video_device);
+		self->dvb_video_device = g_value_dup_string(value);
+		break;
+	case PROP_BUFFER_DEPTH:
+		self->buffer_depth = g_value_get_uint(value);
+		break;
+	case PROP_DEPTH_INTERVAL:
+		self->depth_interval = g_value_get_uint(value);
+		break;
+	case PROP_LIVE_LATENCY:
+		self->live_latency = g_value_get_uint(value);
+		break;
+	case PROP_FAST_EOS:
+		self->fast_eos = g_value_get_boolean(value);
+		break;
+	case PROP_GAPLESS:
+		self->gapless = g_value_get_boolean(value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbaudiosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_QUEUE_ENTRIES:
+		GST_OBJECT_LOCK(self);
+		g_value_set_uint(value, self->queue.count);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_QUEUE_BYTES:
+		GST_OBJECT_LOCK(self);
+		g_value_set_uint64(value, self->queue.bytes);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_RESUME_TIMEOUT:
+		g_value_set_uint(value, self->resume_timeout);
+		break;
+	case PROP_FAST_ZAP:
+		g_value_set_boolean(value, self->fast_zap);
+		break;
+	case PROP_WRITER_THREAD:
+		g_value_set_boolean(value, self->writer_thread);
+		break;
+	case PROP_RING_SIZE:
+		g_value_set_uint(value, self->ring_size);
+		break;
+	case PROP_RING_BYTES:
+		g_value_set_uint64(value, g_atomic_int_get(&self->ring.bytes));
+		break;
+	case PROP_RING_TIME:
+		g_value_set_uint64(value, (guint64)g_atomic_int_get(&self->ring.time_us) * GST_USECOND);
+		break;
+	case PROP_PROVIDE_CLOCK:
+		g_value_set_boolean(value, self->provide_clock);
+		break;
+	case PROP_POSITION_WINDOW:
+		g_value_set_uint(value, gst_dvbclock_get_interval(GST_DVBCLOCK(self->clock)) / GST_MSECOND);
+		break;
+	case PROP_POSITION_HITS:
+	{
+		guint64 hits;
+		gst_dvbclock_get_stats(GST_DVBCLOCK(self->clock), &hits, NULL);
+		g_value_set_uint64(value, hits);
+		break;
+	}
+	case PROP_POSITION_MISSES:
+	{
+		guint64 misses;
+		gst_dvbclock_get_stats(GST_DVBCLOCK(self->clock), NULL, &misses);
+		g_value_set_uint64(value, misses);
+		break;
+	}
+	case PROP_AGGREGATE_LATENCY:
+		g_value_set_uint(value, self->aggregate_latency);
+		break;
+	case PROP_ADAPTER:
+		g_value_set_uint(value, self->dvb_adapter);
+		break;
+	case PROP_DECODER:
+		g_value_set_uint(value, self->dvb_decoder);
+		break;
+	case PROP_DEVICE:
+		g_value_set_string(value, self->dvb_device);
+		break;
+	case PROP_VIDEO_DEVICE:
+		g_value_set_string(value, self->dvb_video_device);
+		break;
+	case PROP_BUFFER_DEPTH:
+		g_value_set_uint(value, self->buffer_depth);
+		break;
+	case PROP_DEPTH_INTERVAL:
+		g_value_set_uint(value, self->depth_interval);
+		break;
+	case PROP_LIVE_LATENCY:
+		g_value_set_uint(value, self->live_latency);
+		break;
+	case PROP_LIVE_DROPPED:
+		g_value_set_uint64(value, self->live_dropped);
+		break;
+	case PROP_FAST_EOS:
+		g_value_set_boolean(value, self->fast_eos);
+		break;
+	case PROP_GAPLESS:
+		g_value_set_boolean(value, self->gapless);
+		break;
+	case PROP_STATS:
+		g_value_take_boxed(value, sink_stats_to_structure(&self->stats, "GstDVBAudioSinkStats"));
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static GstClockTime gst_dvbaudiosink_sample_decoder_time(GstClock *clock, gpointer user_data)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(user_data);
 	gint64 cur = 0;
 	if (self->fd < 0 || !self->playing || !self->pts_written){return GST_CLOCK_TIME_NONE;}
 
@@ -300,7 +676,41 @@ static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self)
 	cur *= 11111;
 	cur -= self->timestamp_offset;
 
-	return cur;
+	return cur > 0 ? cur : 0;
+}
+
+/* served from the clock, which only asks the decoder once per sample interval */
+static gint64 gst_dvbaudiosink_get_decoder_time(GstDVBAudioSink *self)
+{
+	return (gint64)gst_dvbclock_get_decoder_time(GST_DVBCLOCK(self->clock));
+}
+
+static gint64 gst_dvbaudiosink_depth(gpointer data)
+{
+	GstDVBAudioSink *self = data;
+	if (self->written_position < 0) return -1;
+	return decoder_depth(self->written_position, gst_dvbaudiosink_get_decoder_time(self));
+}
+
+/* fast-eos: time until the decoder position reaches the last written pts, 0 once it did, -1 while unknown */
+static gint64 gst_dvbaudiosink_drain_estimate(GstDVBAudioSink *self)
+{
+	gint64 position;
+	if (self->written_pts < 0) return -1;
+	position = gst_dvbaudiosink_get_decoder_time(self);
+	if (position < 0) return -1;
+	return MAX(self->written_pts - position, 0);
+}
+
+static GstClock *gst_dvbaudiosink_provide_clock(GstElement *element)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(element);
+	GstClock *clock = NULL;
+
+	GST_OBJECT_LOCK(self);
+	if (self->provide_clock) clock = GST_CLOCK(gst_object_ref(self->clock));
+	GST_OBJECT_UNLOCK(self);
+	return clock;
 }
 
 static gboolean gst_dvbaudiosink_unlock(GstBaseSink *basesink)
@@ -309,6 +719,7 @@ static gboolean gst_dvbaudiosink_unlock(GstBaseSink *basesink)
 	self->unlocking = TRUE;
 	/* wakeup the poll */
 	write(self->unlockfd[1], "\x01", 1);
+	if (self->ring.thread) pes_ring_wakeup(&self->ring);
 	GST_DEBUG_OBJECT(basesink, "unlock");
 	return TRUE;
 }
@@ -321,7 +732,7 @@ static gboolean gst_dvbaudiosink_unlock_stop(GstBaseSink *basesink)
 	return TRUE;
 }
 
-static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink, GstCaps *filter)
+static GstCaps *gst_dvbaudiosink_build_caps(gboolean downmix)
 {
 	GstCaps *caps = gst_caps_from_string(
 		MPEGCAPS 
@@ -348,19 +759,37 @@ static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink, GstCaps *filter
 #endif
 
 #ifdef HAVE_DTSDOWNMIX
-	if (!get_downmix_setting())
+	if (!downmix)
 	{
 		gst_caps_append(caps, gst_caps_from_string(DTSCAPS));
 	}
 #endif
+	return caps;
+}
+
+static GstCaps *gst_dvbaudiosink_get_caps(GstBaseSink *basesink, GstCaps *filter)
+{
+	/* the caps only depend on the downmix setting, parse each variant once */
+	static GstCaps *cached_caps[2] = { NULL, NULL };
+	gboolean downmix = FALSE;
+	GstCaps *caps;
+
+#ifdef HAVE_DTSDOWNMIX
+	downmix = get_downmix_setting() ? 1 : 0;
+#endif
+	if (g_once_init_enter(&cached_caps[downmix]))
+	{
+		caps = gst_dvbaudiosink_build_caps(downmix);
+		GST_MINI_OBJECT_FLAG_SET(caps, GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
+		g_once_init_leave(&cached_caps[downmix], caps);
+	}
+	caps = cached_caps[downmix];
 
 	if (filter)
 	{
-		GstCaps *intersection = gst_caps_intersect_full(filter, caps, GST_CAPS_INTERSECT_FIRST);
-		gst_caps_unref(caps);
-		caps = intersection;
+		return gst_caps_intersect_full(filter, caps, GST_CAPS_INTERSECT_FIRST);
 	}
-	return caps;
+	return gst_caps_ref(caps);
 }
 
 static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
@@ -369,16 +798,20 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 	GstStructure *structure = gst_caps_get_structure(caps, 0);
 	const char *type = gst_structure_get_name(structure);
 	t_audio_type bypass = AUDIOTYPE_UNKNOWN;
+	/* kept until we know whether the decoder setup changed */
+	GstBuffer *prev_codec_data = self->codec_data;
+	gboolean reconfigure = TRUE;
 
-	self->skip = 0;
-	self->aac_adts_header_valid = FALSE;
-
-	if (self->codec_data)
+	/* pending frames belong to the previous setup */
+	if (gst_dvbaudiosink_flush_aggregate(self) < 0)
 	{
-		gst_buffer_unref(self->codec_data);
-		self->codec_data = NULL;
+		GST_WARNING_OBJECT(self, "cannot write pending frames: %s", g_strerror(errno));
 	}
 
+	self->skip = 0;
+	self->aac_adts_header_valid = FALSE;
+	self->codec_data = NULL;
+
 	if (!strcmp(type, "audio/mpeg"))
 	{
 		gint mpegversion;
@@ -658,28 +1091,81 @@ static gboolean gst_dvbaudiosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 	else
 	{
 		GST_ELEMENT_ERROR(self, STREAM, TYPE_NOT_FOUND,(NULL),("unimplemented stream type %s", type));
+		if (prev_codec_data) gst_buffer_unref(prev_codec_data);
 		return FALSE;
 	}
 
-	GST_INFO_OBJECT(self, "setting dvb mode 0x%02x\n", bypass);
-
-	if (self->playing)
+	if ((self->fast_zap || self->gapless) && (self->playing || self->gapless_kept) && self->fd >= 0 && bypass == self->bypass && buffer_equal(self->codec_data, prev_codec_data))
 	{
-		if (self->fd >= 0) ioctl(self->fd, AUDIO_STOP, 0);
-		self->playing = FALSE;
+		GST_INFO_OBJECT(self, "%s, keep dvb mode 0x%02x", self->gapless_kept ? "gapless" : "fast zap", bypass);
+		reconfigure = FALSE;
+		/* a kept decoder was never stopped, it only waits for the next AUDIO_CONTINUE */
+		self->playing = TRUE;
+		self->gapless_kept = FALSE;
+		if (self->codec_data)
+		{
+			/* keep the previous codec_data, the template was built from it */
+			gst_buffer_unref(self->codec_data);
+			self->codec_data = prev_codec_data;
+			prev_codec_data = NULL;
+		}
 	}
-	if (self->fd < 0 || ioctl(self->fd, AUDIO_SET_BYPASS_MODE, bypass) < 0)
+	if (prev_codec_data) gst_buffer_unref(prev_codec_data);
+
+	if (reconfigure)
 	{
-		GST_ELEMENT_ERROR(self, STREAM, TYPE_NOT_FOUND,(NULL),("hardware decoder can't be set to bypass mode type %s", type));
-		return FALSE;
+		GST_INFO_OBJECT(self, "setting dvb mode 0x%02x\n", bypass);
+
+		if (self->playing || self->gapless_kept)
+		{
+			if (self->fd >= 0) ioctl(self->fd, AUDIO_STOP, 0);
+			self->playing = FALSE;
+		}
+		self->gapless_kept = FALSE;
+		if (self->fd < 0 || ioctl(self->fd, AUDIO_SET_BYPASS_MODE, bypass) < 0)
+		{
+			GST_ELEMENT_ERROR(self, STREAM, TYPE_NOT_FOUND,(NULL),("hardware decoder can't be set to bypass mode type %s", type));
+			return FALSE;
+		}
+		if (self->fd >= 0) ioctl(self->fd, AUDIO_PLAY);
+		self->playing = TRUE;
 	}
-	if (self->fd >= 0) ioctl(self->fd, AUDIO_PLAY);
-	self->playing = TRUE;
 
 	self->bypass = bypass;
+	gst_dvbaudiosink_select_codec(self);
 	return TRUE;
 }
 
+/*
+ * let the video decoder (video-device, or the one of the same adapter and decoder
+ * index) follow the rate, unless a video sink
+ * on it handles the rate itself. The device is only held for the ioctls, so the
+ * video decoder stays free for other users during audio only playback.
+ */
+static void gst_dvbaudiosink_set_video_rate(GstDVBAudioSink *self, gdouble rate, gboolean resume)
+{
+	/* borrowed, a video sink on the decoder keeps its own reference */
+	int video_fd = self->dvb_video_device ? dvb_device_open_path(self->dvb_video_device, FALSE) : dvb_device_open("video", self->dvb_adapter, self->dvb_decoder, FALSE);
+
+	if (video_fd < 0) return;
+	if (dvb_device_users(video_fd) == 1)
+	{
+		int skip = 0, repeat = 0;
+		if (rate > 1.0)
+		{
+			skip = (int)rate;
+		}
+		else if (rate < 1.0)
+		{
+			repeat = 1.0 / rate;
+		}
+		ioctl(video_fd, VIDEO_SLOWMOTION, repeat);
+		ioctl(video_fd, VIDEO_FAST_FORWARD, skip);
+		if (resume) ioctl(video_fd, VIDEO_CONTINUE);
+	}
+	dvb_device_close(video_fd);
+}
+
 static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
@@ -698,24 +1184,23 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 		self->flushing = TRUE;
 		/* wakeup the poll */
 		write(self->unlockfd[1], "\x01", 1);
+		if (self->ring.thread) pes_ring_wakeup(&self->ring);
 		if(self->paused) ret = GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
 		break;
 	case GST_EVENT_FLUSH_STOP:
+		/* the writer drops its packets while flushing, wait until it is done */
+		if (self->ring.thread) pes_ring_wait_idle(&self->ring, NULL, NULL);
 		if (self->fd >= 0) ioctl(self->fd, AUDIO_CLEAR_BUFFER);
+		gst_dvbclock_reset(GST_DVBCLOCK(self->clock));
+		self->written_position = self->written_pts = -1;
 		GST_OBJECT_LOCK(self);
-		while (self->queue)
-		{
-			queue_pop(&self->queue);
-		}
+		queue_clear(&self->queue);
 		self->flushing = FALSE;
 		self->timestamp = GST_CLOCK_TIME_NONE;
 		self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
-		if (self->cache)
-		{
-			gst_buffer_unref(self->cache);
-			self->cache = NULL;
-		}
+		gst_adapter_clear(self->adapter);
 		GST_OBJECT_UNLOCK(self);
+		gst_dvbaudiosink_discard_aggregate(self);
 		if(self->paused) ret = GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
 		/* flush while media is playing requires a delay before rendering */
 		if(self->using_dts_downmix)
@@ -734,11 +1219,33 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 		pfd[1].fd = self->fd;
 		pfd[1].events = POLLIN;
 		GST_BASE_SINK_PREROLL_UNLOCK(sink);
-		while (1)
+		if (gst_dvbaudiosink_flush_aggregate(self) < 0)
+		{
+			GST_WARNING_OBJECT(self, "cannot write pending frames: %s", g_strerror(errno));
+		}
+		if (self->ring.thread && !pes_ring_wait_idle(&self->ring, gst_dvbaudiosink_ring_cancel, self))
+		{
+			GST_DEBUG_OBJECT(self, "wait EOS aborted while draining the writer thread");
+			ret = FALSE;
+		}
+		/* flush start and unlock write to unlockfd, so there is no need to time out */
+		while (ret)
 		{
-			int retval = poll(pfd, 2, 250);
+			int timeout = -1;
+			if (self->fast_eos)
+			{
+				gint64 remaining = gst_dvbaudiosink_drain_estimate(self);
+				if (remaining == 0)
+				{
+					GST_DEBUG_OBJECT(self, "decoder reached the last written pts");
+					break;
+				}
+				if (remaining > 0) timeout = MAX(remaining / GST_MSECOND, 1);
+			}
+			int retval = poll(pfd, 2, timeout);
 			if (retval < 0)
 			{
+				if (errno == EINTR) continue;
 				perror("poll in EVENT_EOS");
 				ret = FALSE;
 				break;
@@ -787,28 +1294,11 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
  		if (format == GST_FORMAT_TIME)
 		{
 			self->timestamp_offset = start - pos;
+			gst_dvbclock_reset(GST_DVBCLOCK(self->clock));
 
 			if (rate != self->rate)
 			{
-				int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
-				if (video_fd >= 0)
-				{
-					GST_INFO_OBJECT(self, "GST_EVENT_SEGMENT IS VIDEO0 OPEN ?");
-					int skip = 0, repeat = 0;
-					if (rate > 1.0)
-					{
-						skip = (int)rate;
-					}
-					else if (rate < 1.0)
-					{
-						repeat = 1.0 / rate;
-					}
-					ioctl(video_fd, VIDEO_SLOWMOTION, repeat);
-					ioctl(video_fd, VIDEO_FAST_FORWARD, skip);
-					ioctl(video_fd, VIDEO_CONTINUE);
-					close(video_fd);
-					video_fd = -1;
-				}
+				gst_dvbaudiosink_set_video_rate(self, rate, TRUE);
 				self->rate = rate;
 				ret = GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
 			}
@@ -869,42 +1359,41 @@ static gboolean gst_dvbaudiosink_event(GstBaseSink *sink, GstEvent *event)
 	return ret;
 }
 
-static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, size_t end)
+static int audio_write(GstDVBAudioSink *self, pes_packet_t *packet)
 {
-	size_t written = start;
-	size_t len = end;
 	struct pollfd pfd[2];
-	guint8 *data;
 	int retval = 0;
-	GstMapInfo map;
-	gst_buffer_map(buffer, &map, GST_MAP_READ);
-	data = map.data;
 
 	pfd[0].fd = self->unlockfd[0];
 	pfd[0].events = POLLIN;
 	pfd[1].fd = self->fd;
 	pfd[1].events = POLLOUT;
 
-	do
+	while (packet->size > 0)
 	{
 		if (self->flushing)
 		{
-			GST_INFO_OBJECT(self, "flushing, skip %d bytes", len - written);
+			GST_INFO_OBJECT(self, "flushing, skip %d bytes", packet->size);
 			break;
 		}
 		else if (self->paused || self->unlocking)
 		{
+			size_t queued = packet->size;
 			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, buffer, written, end);
+			pes_packet_queue(packet, &self->queue);
+			sink_stats_queued(&self->stats, self->queue.bytes);
 			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", len - written);
+			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", queued);
 			break;
 		}
 		else
 		{
-			GST_LOG_OBJECT(self, "going into poll, have %d bytes to write", len - written);
+			GST_LOG_OBJECT(self, "going into poll, have %d bytes to write", packet->size);
 		}
-		if (poll(pfd, 2, -1) < 0)
+		gint64 poll_start = g_get_monotonic_time();
+		int polled = poll(pfd, 2, -1);
+		sink_stats_poll(&self->stats, poll_start);
+		if (polled < 0)
 		{
 			if (errno == EINTR) continue;
 			retval = -1;
@@ -938,6 +1427,7 @@ static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, s
 				gst_buffer_map(queuebuffer, &queuemap, GST_MAP_READ);
 				queuedata = queuemap.data;
 				int wr = write(self->fd, queuedata + queuestart, queueend - queuestart);
+				sink_stats_write(&self->stats, wr, queueend - queuestart);
 				gst_buffer_unmap(queuebuffer, &queuemap);
 				if (wr < 0)
 				{
@@ -960,14 +1450,15 @@ static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, s
 				}
 				else
 				{
-					self->queue->start += wr;
+					queue_advance(&self->queue, wr);
 					GST_DEBUG_OBJECT(self, "written %d queue bytes... update offset", wr);
 				}
 				GST_OBJECT_UNLOCK(self);
 				continue;
 			}
 			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, data + written, len - written);
+			int wr = pes_packet_write(packet, self->fd);
+			sink_stats_write(&self->stats, wr, packet->size);
 			if (wr < 0)
 			{
 				switch(errno)
@@ -981,37 +1472,289 @@ static int audio_write(GstDVBAudioSink *self, GstBuffer *buffer, size_t start, s
 				}
 				if (retval < 0) break;
 			}
-			written += wr;
+			pes_packet_consume(packet, wr);
+			if (!packet->size) sink_stats_packet(&self->stats, packet);
 		}
-	} while (written < len);
+	}
 
-	gst_buffer_unmap(buffer, &map);
 	return retval;
 }
 
+static gboolean gst_dvbaudiosink_ring_cancel(gpointer data)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(data);
+	return self->flushing;
+}
+
+/* writer thread, takes the packets queued by render and writes them to the decoder */
+static gpointer gst_dvbaudiosink_writer(gpointer data)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(data);
+	pes_ring_slot_t *slot;
+	while ((slot = pes_ring_peek(&self->ring)) != NULL)
+	{
+		if (audio_write(self, &slot->packet) < 0)
+		{
+			g_atomic_int_set(&self->writer_error, errno ? errno : EIO);
+		}
+		pes_ring_pop(&self->ring);
+	}
+	return NULL;
+}
+
+static int gst_dvbaudiosink_submit(GstDVBAudioSink *self, pes_packet_t *packet, GstClockTime duration)
+{
+	gint error;
+	if (!self->ring.thread) return audio_write(self, packet);
+	error = g_atomic_int_get(&self->writer_error);
+	if (error)
+	{
+		errno = error;
+		return -3;
+	}
+	/* a packet which is dropped because of a flush is no error, just like in audio_write */
+	if (pes_ring_push(&self->ring, packet, duration, gst_dvbaudiosink_ring_cancel, self) >= 0) return 0;
+	/* a slot cannot hold it, so it is written here once the queued packets are out */
+	if (!pes_ring_wait_idle(&self->ring, gst_dvbaudiosink_ring_cancel, self)) return 0;
+	return audio_write(self, packet);
+}
+
+/* DTS-HD extension data is cut off, the decoder only takes the core */
+static gsize gst_dvbaudiosink_strip_dts(const guint8 *data, gsize size)
+{
+	int pos = 0;
+	while ((pos + 4) <= size)
+	{
+		/* check for DTS-HD */
+		if (!strcmp((char*)(data + pos), "\x64\x58\x20\x25"))
+		{
+			return pos;
+		}
+		++pos;
+	}
+	return size;
+}
+
+static void gst_dvbaudiosink_header_adts(GstDVBAudioSink *self, pes_template_t *template, const guint8 *codec_data, gsize codec_data_size)
+{
+	/* buffer fullness(0x7FF for VBR) over 5 last bits */
+	self->aac_adts_header[5] = 0x1F;
+	/* buffer fullness(0x7FF for VBR) continued over 6 first bits + 2 zeros for
+	 * number of raw data blocks */
+	self->aac_adts_header[6] = 0xFC;
+	pes_template_append(template, self->aac_adts_header, 7);
+}
+
+/* the adts header ends the template, fill in the frame size */
+static gsize gst_dvbaudiosink_patch_adts(GstDVBAudioSink *self, guint8 *pes_header, gsize pes_header_len, const guint8 *data, gsize size)
+{
+	guint8 *adts = pes_header + pes_header_len - 7;
+	size_t payload_len = size + 7;
+	/* frame size over last 2 bits */
+	adts[3] = (adts[3] & 0xC0) | ((payload_len & 0x1800) >> 11);
+	/* frame size continued over full byte */
+	adts[4] = (payload_len & 0x1FF8) >> 3;
+	/* frame size continued first 3 bits, buffer fullness behind it */
+	adts[5] = ((payload_len & 7) << 5) | 0x1F;
+	return pes_header_len;
+}
+
+static gsize gst_dvbaudiosink_patch_lpcm(GstDVBAudioSink *self, guint8 *pes_header, gsize pes_header_len, const guint8 *data, gsize size)
+{
+	if (data[0] < 0xa0 || data[0] > 0xaf)
+	{
+		/*
+		 * gstmpegdemux removes the streamid and the number of frames
+		 * for certain lpcm streams, so we need to reconstruct them.
+		 * Fortunately, the number of frames is ignored.
+		 */
+		pes_header[pes_header_len++] = 0xa0;
+		pes_header[pes_header_len++] = 0x01;
+	}
+	return pes_header_len;
+}
+
+/* wma and raw pcm carry their codec_data, behind the payload size, in every packet */
+static void gst_dvbaudiosink_add_codec_data(pes_template_t *template, const guint8 *codec_data, gsize codec_data_size)
+{
+#if defined(DREAMBOX) || defined(DAGS)
+	pes_template_append(template, "BCMA", 4);
+#endif
+	pes_template_append_length(template, 0);
+	pes_template_append(template, codec_data, codec_data_size);
+}
+
+static void gst_dvbaudiosink_header_wma(GstDVBAudioSink *self, pes_template_t *template, const guint8 *codec_data, gsize codec_data_size)
+{
+	if (codec_data) gst_dvbaudiosink_add_codec_data(template, codec_data, codec_data_size);
+}
+
+static void gst_dvbaudiosink_header_raw(GstDVBAudioSink *self, pes_template_t *template, const guint8 *codec_data, gsize codec_data_size)
+{
+	if (codec_data && codec_data_size >= 18) gst_dvbaudiosink_add_codec_data(template, codec_data, codec_data_size);
+}
+
+static void gst_dvbaudiosink_header_amr(GstDVBAudioSink *self, pes_template_t *template, const guint8 *codec_data, gsize codec_data_size)
+{
+	if (codec_data && codec_data_size >= 17)
+	{
+		pes_template_append_length(template, 17);
+		pes_template_append(template, codec_data + 8, 9);
+	}
+}
+
+/* per codec handling of the frames, picked in set_caps */
+struct audio_codec
+{
+	/* frames go out as they are, without any per frame header data */
+	gboolean aggregate;
+	gsize (*strip)(const guint8 *data, gsize size);
+	/* stream specific header data, added to the template */
+	void (*header)(GstDVBAudioSink *self, pes_template_t *template, const guint8 *codec_data, gsize codec_data_size);
+	/* header data which depends on the frame, returns the new header length */
+	gsize (*patch)(GstDVBAudioSink *self, guint8 *pes_header, gsize pes_header_len, const guint8 *data, gsize size);
+};
+
+static const struct audio_codec audio_codec_plain = { FALSE, NULL, NULL, NULL };
+static const struct audio_codec audio_codec_frames = { TRUE, NULL, NULL, NULL };
+static const struct audio_codec audio_codec_dts = { FALSE, gst_dvbaudiosink_strip_dts, NULL, NULL };
+static const struct audio_codec audio_codec_adts = { FALSE, NULL, gst_dvbaudiosink_header_adts, gst_dvbaudiosink_patch_adts };
+static const struct audio_codec audio_codec_lpcm = { FALSE, NULL, NULL, gst_dvbaudiosink_patch_lpcm };
+static const struct audio_codec audio_codec_wma = { FALSE, NULL, gst_dvbaudiosink_header_wma, NULL };
+static const struct audio_codec audio_codec_raw = { FALSE, NULL, gst_dvbaudiosink_header_raw, NULL };
+static const struct audio_codec audio_codec_amr = { FALSE, NULL, gst_dvbaudiosink_header_amr, NULL };
+
+static const struct audio_codec *gst_dvbaudiosink_find_codec(GstDVBAudioSink *self)
+{
+	if (self->aac_adts_header_valid) return &audio_codec_adts;
+	switch (self->bypass)
+	{
+	case AUDIOTYPE_AC3:
+	case AUDIOTYPE_AC3_PLUS:
+	case AUDIOTYPE_MPEG:
+	case AUDIOTYPE_MP3:
+	case AUDIOTYPE_AAC:
+	case AUDIOTYPE_AAC_HE:
+	case AUDIOTYPE_AAC_PLUS:
+		return &audio_codec_frames;
+	case AUDIOTYPE_DTS:
+		return &audio_codec_dts;
+	case AUDIOTYPE_LPCM:
+		return &audio_codec_lpcm;
+	case AUDIOTYPE_WMA:
+	case AUDIOTYPE_WMA_PRO:
+		return &audio_codec_wma;
+	case AUDIOTYPE_RAW:
+		return &audio_codec_raw;
+	case AUDIOTYPE_AMR:
+		return &audio_codec_amr;
+	default:
+		return &audio_codec_plain;
+	}
+}
+
+/* pick the frame handling and build the header template of the stream */
+static void gst_dvbaudiosink_select_codec(GstDVBAudioSink *self)
+{
+	GstMapInfo map;
+
+	self->audio_codec = gst_dvbaudiosink_find_codec(self);
+	pes_template_init(&self->pes_template, 0xc0);
+	if (!self->audio_codec->header) return;
+	if (self->codec_data && gst_buffer_map(self->codec_data, &map, GST_MAP_READ))
+	{
+		self->audio_codec->header(self, &self->pes_template, map.data, map.size);
+		gst_buffer_unmap(self->codec_data, &map);
+	}
+	else
+	{
+		self->audio_codec->header(self, &self->pes_template, NULL, 0);
+	}
+}
+
+static void gst_dvbaudiosink_discard_aggregate(GstDVBAudioSink *self)
+{
+	guint i;
+	for (i = 0; i < self->aggregate_count; i++)
+	{
+		mapped_buffer_release(&self->aggregate_unit[i]);
+	}
+	self->aggregate_count = 0;
+	self->aggregate_bytes = 0;
+}
+
+/* write the pending frames as one PES packet, with the pts of the first one */
+static int gst_dvbaudiosink_flush_aggregate(GstDVBAudioSink *self)
+{
+	guint8 *pes_header = self->aggregate_header;
+	gsize pes_header_len;
+	pes_packet_t packet;
+	guint i;
+	int written;
+
+	if (!self->aggregate_count) return 0;
+
+	/* aggregated codecs have no stream specific header data, it fits */
+	pes_header_len = pes_template_apply(&self->pes_template, pes_header, self->aggregate_timestamp, self->aggregate_bytes);
+	pes_set_payload_size(self->aggregate_bytes + pes_header_len - 6, pes_header);
+
+	pes_packet_init(&packet);
+	pes_packet_add(&packet, NULL, 0, pes_header, pes_header_len);
+	for (i = 0; i < self->aggregate_count; i++)
+	{
+		mapped_buffer_t *unit = &self->aggregate_unit[i];
+		pes_packet_add(&packet, unit->buffer, 0, unit->map.data, unit->map.size);
+	}
+	GST_LOG_OBJECT(self, "%u frames, %u bytes in one packet", self->aggregate_count, (guint)self->aggregate_bytes);
+	written = gst_dvbaudiosink_submit(self, &packet, self->aggregate_duration);
+	pes_packet_free(&packet);
+	if (written >= 0 && self->aggregate_timestamp != GST_CLOCK_TIME_NONE)
+	{
+		self->pts_written = TRUE;
+		self->written_pts = (gint64)self->aggregate_timestamp - self->timestamp_offset;
+		self->written_position = (gint64)(self->aggregate_timestamp + self->aggregate_duration) - self->timestamp_offset;
+	}
+	gst_dvbaudiosink_discard_aggregate(self);
+	return written;
+}
+
+static int gst_dvbaudiosink_aggregate(GstDVBAudioSink *self, GstBuffer *buffer, GstClockTime timestamp, GstClockTime duration)
+{
+	gsize size = gst_buffer_get_size(buffer);
+
+	if (self->aggregate_count >= AUDIO_AGGREGATE_MAX_UNITS || self->aggregate_bytes + size > AUDIO_AGGREGATE_MAX_BYTES)
+	{
+		if (gst_dvbaudiosink_flush_aggregate(self) < 0) return -1;
+	}
+	if (!self->aggregate_count)
+	{
+		self->aggregate_timestamp = timestamp;
+		self->aggregate_duration = 0;
+	}
+	mapped_buffer_set(&self->aggregate_unit[self->aggregate_count++], buffer);
+	self->aggregate_bytes += size;
+	/* without a duration the latency cannot be bounded, so do not hold on to the frame */
+	if (duration == GST_CLOCK_TIME_NONE) return gst_dvbaudiosink_flush_aggregate(self);
+	self->aggregate_duration += duration;
+	if (self->aggregate_duration >= self->aggregate_latency * GST_MSECOND) return gst_dvbaudiosink_flush_aggregate(self);
+	return 0;
+}
+
 GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buffer)
 {
 	guint8 *pes_header;
 	gsize pes_header_len = 0;
 	gsize size;
 	guint8 *data, *original_data;
-	guint8 *codec_data = NULL;
-	gsize codec_data_size = 0;
 	GstClockTime timestamp = self->timestamp;
 	GstClockTime duration = GST_BUFFER_DURATION(buffer);
-	GstMapInfo map, pesheadermap, codecdatamap;
+	pes_packet_t packet;
+	GstMapInfo map;
 	gst_buffer_map(buffer, &map, GST_MAP_READ);
 	original_data = data = map.data;
 	size = map.size;
-	gst_buffer_map(self->pesheader_buffer, &pesheadermap, GST_MAP_WRITE);
-	pes_header = pesheadermap.data;
+	pes_header = self->pesheader.map.data;
 
-	if (self->codec_data)
-	{
-		gst_buffer_map(self->codec_data, &codecdatamap, GST_MAP_READ);
-		codec_data = codecdatamap.data;
-		codec_data_size = codecdatamap.size;
-	}
 	/* 
 	 * Some audioformats have incorrect timestamps, 
 	 * so if we have both a timestamp and a duration, 
@@ -1038,141 +1781,37 @@ GstFlowReturn gst_dvbaudiosink_push_buffer(GstDVBAudioSink *self, GstBuffer *buf
 		}
 	}
 
-	pes_header[0] = 0;
-	pes_header[1] = 0;
-	pes_header[2] = 1;
-	pes_header[3] = 0xc0;
-
-	pes_header[6] = 0x81;
-	pes_header[7] = 0; /* no pts */
-	pes_header[8] = 0;
-	pes_header_len = 9;
-
-	if (self->bypass == AUDIOTYPE_DTS)
+	if (self->aggregate_latency && self->audio_codec->aggregate && size <= AUDIO_AGGREGATE_MAX_BYTES)
 	{
-		int pos = 0;
-		while ((pos + 4) <= size)
-		{
-			/* check for DTS-HD */
-			if (!strcmp((char*)(data + pos), "\x64\x58\x20\x25"))
-			{
-				size = pos;
-				break;
-			}
-			++pos;
-		}
+		if (gst_dvbaudiosink_aggregate(self, buffer, timestamp, duration) < 0) goto error;
+		gst_buffer_unmap(buffer, &map);
+		return GST_FLOW_OK;
 	}
+	/* keep the order, pending frames go first */
+	if (gst_dvbaudiosink_flush_aggregate(self) < 0) goto error;
 
-	if (timestamp != GST_CLOCK_TIME_NONE)
-	{
-		pes_header[7] = 0x80; /* pts */
-		pes_header[8] = 5; /* pts size */
-		pes_header_len += 5;
-		pes_set_pts(timestamp, pes_header);
-	}
-
-	if (self->aac_adts_header_valid)
-	{
-		size_t payload_len = size + 7;
-		self->aac_adts_header[3] &= 0xC0;
-		/* frame size over last 2 bits */
-		self->aac_adts_header[3] |= (payload_len & 0x1800) >> 11;
-		/* frame size continued over full byte */
-		self->aac_adts_header[4] = (payload_len & 0x1FF8) >> 3;
-		/* frame size continued first 3 bits */
-		self->aac_adts_header[5] = (payload_len & 7) << 5;
-		/* buffer fullness(0x7FF for VBR) over 5 last bits */
-		self->aac_adts_header[5] |= 0x1F;
-		/* buffer fullness(0x7FF for VBR) continued over 6 first bits + 2 zeros for
-		 * number of raw data blocks */
-		self->aac_adts_header[6] = 0xFC;
-		memcpy(pes_header + pes_header_len, self->aac_adts_header, 7);
-		pes_header_len += 7;
-	}
+	if (self->audio_codec->strip) size = self->audio_codec->strip(data, size);
 
-	if (self->bypass == AUDIOTYPE_LPCM && (data[0] < 0xa0 || data[0] > 0xaf))
-	{
-		/*
-		 * gstmpegdemux removes the streamid and the number of frames
-		 * for certain lpcm streams, so we need to reconstruct them.
-		 * Fortunately, the number of frames is ignored.
-		 */
-		pes_header[pes_header_len++] = 0xa0;
-		pes_header[pes_header_len++] = 0x01;
-	}
-	else if (self->bypass == AUDIOTYPE_WMA || self->bypass == AUDIOTYPE_WMA_PRO)
-	{
-		if (self->codec_data)
-		{
-			size_t payload_len = size;
-#if defined(DREAMBOX) || defined(DAGS)
-			pes_header[pes_header_len++] = 0x42; // B
-			pes_header[pes_header_len++] = 0x43; // C
-			pes_header[pes_header_len++] = 0x4D; // M
-			pes_header[pes_header_len++] = 0x41; // A
-#endif
-			pes_header[pes_header_len++] = (payload_len >> 24) & 0xff;
-			pes_header[pes_header_len++] = (payload_len >> 16) & 0xff;
-			pes_header[pes_header_len++] = (payload_len >> 8) & 0xff;
-			pes_header[pes_header_len++] = payload_len & 0xff;
-			memcpy(&pes_header[pes_header_len], codec_data, codec_data_size);
-			pes_header_len += codec_data_size;
-		}
-	}
-	else if (self->bypass == AUDIOTYPE_AMR)
-	{
-		if (self->codec_data && codec_data_size >= 17)
-		{
-			size_t payload_len = size + 17;
-			pes_header[pes_header_len++] = (payload_len >> 24) & 0xff;
-			pes_header[pes_header_len++] = (payload_len >> 16) & 0xff;
-			pes_header[pes_header_len++] = (payload_len >> 8) & 0xff;
-			pes_header[pes_header_len++] = payload_len & 0xff;
-			memcpy(&pes_header[pes_header_len], codec_data + 8, 9);
-			pes_header_len += 9;
-		}
-	}
-	else if (self->bypass == AUDIOTYPE_RAW)
-	{
-		if (self->codec_data && codec_data_size >= 18)
-		{
-			size_t payload_len = size;
-#if defined(DREAMBOX) || defined(DAGS)
-			pes_header[pes_header_len++] = 0x42; // B
-			pes_header[pes_header_len++] = 0x43; // C
-			pes_header[pes_header_len++] = 0x4D; // M
-			pes_header[pes_header_len++] = 0x41; // A
-#endif
-			pes_header[pes_header_len++] = (payload_len >> 24) & 0xff;
-			pes_header[pes_header_len++] = (payload_len >> 16) & 0xff;
-			pes_header[pes_header_len++] = (payload_len >> 8) & 0xff;
-			pes_header[pes_header_len++] = payload_len & 0xff;
-			memcpy(&pes_header[pes_header_len], codec_data, codec_data_size);
-			pes_header_len += codec_data_size;
-		}
-	}
+	pes_header_len = pes_template_apply(&self->pes_template, pes_header, timestamp, size);
+	if (self->audio_codec->patch) pes_header_len = self->audio_codec->patch(self, pes_header, pes_header_len, data, size);
 
 	pes_set_payload_size(size + pes_header_len - 6, pes_header);
-	if (audio_write(self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
-	if (audio_write(self, buffer, data - original_data, data - original_data + size) < 0) goto error;
+	pes_packet_init(&packet);
+	pes_packet_add(&packet, NULL, 0, pes_header, pes_header_len);
+	pes_packet_add(&packet, buffer, data - original_data, data, size);
+	int written = gst_dvbaudiosink_submit(self, &packet, duration);
+	pes_packet_free(&packet);
+	if (written < 0) goto error;
 	if (timestamp != GST_CLOCK_TIME_NONE)
 	{
 		self->pts_written = TRUE;
-	}
-	gst_buffer_unmap(self->pesheader_buffer, &pesheadermap);
-	if (self->codec_data)
-	{
-		gst_buffer_unmap(self->codec_data, &codecdatamap);
+		self->written_pts = (gint64)timestamp - self->timestamp_offset;
+		self->written_position = (gint64)(timestamp + (duration != GST_CLOCK_TIME_NONE ? duration : 0)) - self->timestamp_offset;
 	}
 	gst_buffer_unmap(buffer, &map);
 
 	return GST_FLOW_OK;
 error:
-	gst_buffer_unmap(self->pesheader_buffer, &pesheadermap);
-	if (self->codec_data)
-	{
-		gst_buffer_unmap(self->codec_data, &codecdatamap);
-	}
 	gst_buffer_unmap(buffer, &map);
 	{
 		GST_ELEMENT_ERROR(self, RESOURCE, READ,(NULL),
@@ -1194,12 +1833,12 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 	gint i = 0;
 	if (self->ok_to_write == 0)
 	{
-		/* wait 1 seconds after flush and new segment */
+		/* after a flush, wait until the decoder is ready (at most resume-timeout ms) */
 		self->flushed = FALSE;
 		self->ok_to_write = 1;
 		self->playing = TRUE;
-		gst_sleepms(1000);
-		GST_INFO_OBJECT(self,"RESUME PLAY AFTER FLUSH + 1 SECOND");
+		wait_decoder_ready(self->fd, self->unlockfd[0], self->resume_timeout);
+		GST_INFO_OBJECT(self, "resume play after flush");
 	}
 	if (self->bypass <= AUDIOTYPE_UNKNOWN)
 	{
@@ -1209,13 +1848,34 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 
 	if (self->fd < 0) return GST_FLOW_ERROR;
 
+	/* a paused decoder does not drain, audio_write queues instead */
+	decoder_throttle(GST_ELEMENT(self), self->unlockfd[0], gst_dvbaudiosink_depth, self, self->buffer_depth,
+		self->depth_interval, &self->depth_reported, !self->paused && !self->flushing && !self->unlocking);
+	if (self->live_latency)
+	{
+		/* live mode, every audio frame can go */
+		gint64 depth = gst_dvbaudiosink_depth(self);
+		if (depth > (gint64)self->live_latency * GST_MSECOND)
+		{
+			self->live_dropped++;
+			GST_DEBUG_OBJECT(self, "%" GST_TIME_FORMAT " ahead of the decoder, drop frame", GST_TIME_ARGS(depth));
+			/* move the extrapolated pts past the dropped frame, as push_buffer would have */
+			if (self->timestamp != GST_CLOCK_TIME_NONE && duration != GST_CLOCK_TIME_NONE)
+				self->timestamp += duration;
+			else
+				self->timestamp = GST_CLOCK_TIME_NONE;
+			return GST_FLOW_OK;
+		}
+	}
+
 	if (GST_BUFFER_IS_DISCONT(buffer)) 
 	{
-		if (self->cache) 
+		if (gst_dvbaudiosink_flush_aggregate(self) < 0)
 		{
-			gst_buffer_unref(self->cache);
-			self->cache = NULL;
+			GST_ELEMENT_ERROR(self, RESOURCE, READ,(NULL), ("audio write: %s", g_strerror(errno)));
+			return GST_FLOW_ERROR;
 		}
+		gst_adapter_clear(self->adapter);
 		self->timestamp = GST_CLOCK_TIME_NONE;
 		self->fixed_buffertimestamp = GST_CLOCK_TIME_NONE;
 	}
@@ -1235,17 +1895,6 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 		buffersize = gst_buffer_get_size(buffer);
 	}
 
-	if (self->cache)
-	{
-		/* join unrefs both buffers */
-		buffer = gst_buffer_append(self->cache, buffer);
-		buffersize = gst_buffer_get_size(buffer);
-		GST_BUFFER_PTS(buffer) = timestamp;
-		GST_BUFFER_DURATION(buffer) = duration;
-		disposebuffer = buffer;
-		self->cache = NULL;
-	}
-
 	if (buffer)
 	{
 		if (self->fixed_buffersize)
@@ -1254,29 +1903,23 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 			{
 				self->fixed_buffertimestamp = timestamp;
 			}
-			if (buffersize < self->fixed_buffersize)
-			{
-				self->cache = gst_buffer_copy(buffer);
-				retval = GST_FLOW_OK;
-			}
-			else if (buffersize > self->fixed_buffersize)
+			if (gst_adapter_available(self->adapter) || buffersize != self->fixed_buffersize)
 			{
-				int index = 0;
-				while (index <= buffersize - self->fixed_buffersize)
+				/*
+				 * The adapter hands out blocks as subbuffers of the input,
+				 * only a block straddling two input buffers gets merged.
+				 */
+				gst_adapter_push(self->adapter, gst_buffer_ref(buffer));
+				while (gst_adapter_available(self->adapter) >= self->fixed_buffersize)
 				{
 					GstBuffer *block;
-					block = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, index, self->fixed_buffersize);
+					block = gst_buffer_make_writable(gst_adapter_take_buffer(self->adapter, self->fixed_buffersize));
 					/* only the first buffer needs the correct timestamp, next buffer timestamps will be ignored (and extrapolated) */
 					GST_BUFFER_PTS(block) = self->fixed_buffertimestamp;
 					GST_BUFFER_DURATION(block) = self->fixed_bufferduration;
 					self->fixed_buffertimestamp += self->fixed_bufferduration;
 					gst_dvbaudiosink_push_buffer(self, block);
 					gst_buffer_unref(block);
-					index += self->fixed_buffersize;
-				}
-				if (index < buffersize)
-				{
-					self->cache = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, index, buffersize - index);
 				}
 				retval = GST_FLOW_OK;
 			}
@@ -1307,6 +1950,14 @@ static GstFlowReturn gst_dvbaudiosink_render(GstBaseSink *sink, GstBuffer *buffe
 	return retval;
 }
 
+/* same as the video sink, page aligned memory for write() */
+static gboolean gst_dvbaudiosink_propose_allocation(GstBaseSink *sink, GstQuery *query)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(sink);
+	GST_DEBUG_OBJECT(self, "propose page aligned allocation");
+	return propose_page_allocation(query, POOL_BUFFER_SIZE, 2);
+}
+
 static gboolean gst_dvbaudiosink_start(GstBaseSink * basesink)
 {
 	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
@@ -1322,12 +1973,24 @@ static gboolean gst_dvbaudiosink_start(GstBaseSink * basesink)
 	fcntl(self->unlockfd[0], F_SETFL, O_NONBLOCK);
 	fcntl(self->unlockfd[1], F_SETFL, O_NONBLOCK);
 
-	self->pesheader_buffer = gst_buffer_new_and_alloc(256);
+	mapped_buffer_alloc(&self->pesheader, 256);
+	self->pes_template.target = NULL;
 
-	self->fd = open("/dev/dvb/adapter0/audio0", O_RDWR | O_NONBLOCK);
+	if (self->gapless_kept)
+		GST_INFO_OBJECT(self, "gapless, reuse the running decoder");
+	else
+		self->fd = self->dvb_device ? dvb_device_open_path(self->dvb_device, TRUE) : dvb_device_open("audio", self->dvb_adapter, self->dvb_decoder, TRUE);
+
+	self->writer_error = 0;
+	if (self->writer_thread && self->fd >= 0 && !pes_ring_start(&self->ring, self->ring_size, "dvbaudiosink-writer", gst_dvbaudiosink_writer, self))
+	{
+		GST_WARNING_OBJECT(self, "cannot start writer thread, writing from render");
+	}
 
 	self->pts_written = FALSE;
 	self->lastpts = 0;
+	self->written_position = self->written_pts = -1;
+	sink_stats_reset(&self->stats);
 
 	return TRUE;
 error:
@@ -1338,15 +2001,11 @@ error:
 	}
 }
 
-static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
+static void gst_dvbaudiosink_close_decoder(GstDVBAudioSink *self)
 {
-	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
-
-	GST_DEBUG_OBJECT(self, "stop");
-
 	if (self->fd >= 0)
 	{
-		if (self->playing)
+		if (self->playing || self->gapless_kept)
 		{
 			ioctl(self->fd, AUDIO_STOP);
 			self->playing = FALSE;
@@ -1355,41 +2014,53 @@ static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
 
 		if (self->rate != 1.0)
 		{
-			int video_fd = open("/dev/dvb/adapter0/video0", O_RDWR);
-			if (video_fd >= 0)
-			{
-				ioctl(video_fd, VIDEO_SLOWMOTION, 0);
-				ioctl(video_fd, VIDEO_FAST_FORWARD, 0);
-				close(video_fd);
-			}
+			gst_dvbaudiosink_set_video_rate(self, 1.0, FALSE);
 			self->rate = 1.0;
 		}
-		close(self->fd);
+		dvb_device_close(self->fd);
 		self->fd = -1;
 	}
+	self->gapless_kept = FALSE;
 
 	if (self->codec_data)
 	{
 		gst_buffer_unref(self->codec_data);
 		self->codec_data = NULL;
 	}
+}
+
+static gboolean gst_dvbaudiosink_stop(GstBaseSink * basesink)
+{
+	GstDVBAudioSink *self = GST_DVBAUDIOSINK(basesink);
 
-	if (self->pesheader_buffer)
+	GST_DEBUG_OBJECT(self, "stop");
+	if (self->ring.thread)
 	{
-		gst_buffer_unref(self->pesheader_buffer);
-		self->pesheader_buffer = NULL;
+		/* let the writer drop what is left */
+		self->flushing = TRUE;
+		write(self->unlockfd[1], "\x01", 1);
+		pes_ring_stop(&self->ring);
+		self->flushing = FALSE;
 	}
 
-	if (self->cache)
+	if (self->gapless && self->fd >= 0 && self->bypass > AUDIOTYPE_UNKNOWN && self->rate == 1.0)
 	{
-		gst_buffer_unref(self->cache);
-		self->cache = NULL;
+		/* leave the decoder set up, the next stream continues on it if the codec matches */
+		GST_INFO_OBJECT(self, "gapless, keep dvb mode 0x%02x", self->bypass);
+		self->gapless_kept = TRUE;
+		self->playing = FALSE;
 	}
-
-	while (self->queue)
+	else
 	{
-		queue_pop(&self->queue);
+		gst_dvbaudiosink_close_decoder(self);
 	}
+	mapped_buffer_release(&self->pesheader);
+	gst_dvbaudiosink_discard_aggregate(self);
+
+	gst_adapter_clear(self->adapter);
+
+	queue_clear(&self->queue);
+	gst_dvbclock_reset(GST_DVBCLOCK(self->clock));
 
 	/* close write end first */
 	if (self->unlockfd[1] >= 0)
@@ -1423,11 +2094,13 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 		self->paused = TRUE;
 		if (self->fd >= 0)
 		{
-			ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
+			if (!self->gapless_kept) ioctl(self->fd, AUDIO_SELECT_SOURCE, AUDIO_SOURCE_MEMORY);
 			ioctl(self->fd, AUDIO_PAUSE);
 		}
-		if(get_downmix_ready())
+		if(get_downmix_ready(element))
 			self->using_dts_downmix = TRUE;
+		if (self->provide_clock)
+			gst_element_post_message(element, gst_message_new_clock_provide(GST_OBJECT_CAST(element), self->clock, TRUE));
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_INFO_OBJECT(self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
@@ -1466,9 +2139,13 @@ static GstStateChangeReturn gst_dvbaudiosink_change_state(GstElement *element, G
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_INFO_OBJECT(self,"GST_STATE_CHANGE_PAUSED_TO_READY");
+		if (self->provide_clock)
+			gst_element_post_message(element, gst_message_new_clock_lost(GST_OBJECT_CAST(element), self->clock));
 		break;
 	case GST_STATE_CHANGE_READY_TO_NULL:
 		GST_INFO_OBJECT(self,"GST_STATE_CHANGE_READY_TO_NULL");
+		/* a decoder kept for gapless playback is released here */
+		gst_dvbaudiosink_close_decoder(self);
 		break;
 	default:
 		break;
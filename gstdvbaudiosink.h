@@ -65,6 +65,7 @@ G_BEGIN_DECLS
 
 typedef struct _GstDVBAudioSink		GstDVBAudioSink;
 typedef struct _GstDVBAudioSinkClass	GstDVBAudioSinkClass;
+struct audio_codec;
 typedef struct _GstDVBAudioSinkPrivate	GstDVBAudioSinkPrivate;
 
 #ifdef DREAMBOX
@@ -105,22 +106,35 @@ typedef enum {
 } t_audio_type;
 #endif
 
+/* each unit is a separate buffer, the writer thread ring takes a limited number per packet */
+#define AUDIO_AGGREGATE_MAX_UNITS PES_RING_MAX_OWNERS
+/* the PES packet length field counts everything after it, including 8 header bytes */
+#define AUDIO_AGGREGATE_MAX_BYTES (0xffff - 8)
+
 struct _GstDVBAudioSink
 {
 	GstBaseSink element;
 	guint8 aac_adts_header[7];
 	gboolean aac_adts_header_valid;
 
-	GstBuffer *pesheader_buffer;
+	mapped_buffer_t pesheader;
 	GstBuffer *codec_data;
-	GstBuffer *cache;
+	GstAdapter *adapter;
 	gboolean reset_time;
 
+	guint dvb_adapter;
+	guint dvb_decoder;
+	/* device nodes overriding dvb_adapter and dvb_decoder */
+	gchar *dvb_device;
+	gchar *dvb_video_device;
 	int fd;
 	int unlockfd[2];
 
 	int skip;
 	int bypass;
+	/* frame handling of the bypass type, selected in set_caps */
+	const struct audio_codec *audio_codec;
+	pes_template_t pes_template;
 	int fixed_buffersize;
 	GstClockTime fixed_buffertimestamp;
 	GstClockTime fixed_bufferduration;
@@ -133,8 +147,40 @@ struct _GstDVBAudioSink
 	gint64 lastpts;
 	gint64 timestamp_offset;
 	gint8 ok_to_write;
-
-	queue_entry_t *queue;
+	guint resume_timeout;
+	gboolean fast_zap;
+
+	gboolean writer_thread;
+	guint ring_size;
+	pes_ring_t ring;
+	gint writer_error;
+
+	GstClock *clock;
+	gboolean provide_clock;
+
+	/* access units waiting to go out as one PES packet */
+	guint aggregate_latency;
+	mapped_buffer_t aggregate_unit[AUDIO_AGGREGATE_MAX_UNITS];
+	guint aggregate_count;
+	gsize aggregate_bytes;
+	GstClockTime aggregate_timestamp;
+	GstClockTime aggregate_duration;
+	guint8 aggregate_header[14];
+
+	write_queue_t queue;
+	sink_stats_t stats;
+
+	/* backpressure: end of the last timestamped data written, in stream time */
+	guint buffer_depth, depth_interval;
+	gint64 written_position, written_pts;
+	gint64 depth_reported;
+	/* live mode, drop instead of letting the latency grow */
+	guint live_latency;
+	guint64 live_dropped;
+	gboolean fast_eos;
+	gboolean gapless;
+	/* fd was kept open by stop with the decoder still set up */
+	gboolean gapless_kept;
 };
 
 struct _GstDVBAudioSinkClass
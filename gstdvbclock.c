@@ -0,0 +1,254 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "gstdvbclock.h"
+
+GST_DEBUG_CATEGORY_STATIC(dvbclock_debug);
+#define GST_CAT_DEFAULT dvbclock_debug
+
+static GstClockTime gst_dvbclock_get_internal_time(GstClock *clock);
+
+static void gst_dvbclock_class_init(GstDVBClockClass *klass)
+{
+	GstClockClass *clock_class = GST_CLOCK_CLASS(klass);
+
+	clock_class->get_internal_time = gst_dvbclock_get_internal_time;
+}
+
+static void gst_dvbclock_init(GstDVBClock *self)
+{
+	self->func = NULL;
+	self->user_data = NULL;
+	self->interval = DVBCLOCK_DEFAULT_INTERVAL;
+	self->sample_time = GST_CLOCK_TIME_NONE;
+	self->sample_system = GST_CLOCK_TIME_NONE;
+	self->base = 0;
+	self->last_time = 0;
+	self->running = FALSE;
+	self->last_position = GST_CLOCK_TIME_NONE;
+	self->hits = self->misses = 0;
+	GST_OBJECT_FLAG_SET(self, GST_CLOCK_FLAG_CAN_SET_MASTER);
+}
+
+GType gst_dvbclock_get_type(void)
+{
+	static volatile gsize dvbclock_type = 0;
+
+	if (g_once_init_enter(&dvbclock_type))
+	{
+		/* the video and audio sink plugins both carry a copy of this file, only the first one registers the type */
+		GType type = g_type_from_name("GstDVBClock");
+		if (!type)
+		{
+			type = g_type_register_static_simple(GST_TYPE_SYSTEM_CLOCK, "GstDVBClock",
+				sizeof(GstDVBClockClass), (GClassInitFunc)gst_dvbclock_class_init,
+				sizeof(GstDVBClock), (GInstanceInitFunc)gst_dvbclock_init, 0);
+		}
+		GST_DEBUG_CATEGORY_INIT(dvbclock_debug, "dvbclock", 0, "dvbclock");
+		g_once_init_leave(&dvbclock_type, type);
+	}
+	return dvbclock_type;
+}
+
+GstClock *gst_dvbclock_new(const gchar *name, GstDVBClockGetTimeFunc func, gpointer user_data)
+{
+	GstDVBClock *self = GST_DVBCLOCK(g_object_new(GST_TYPE_DVBCLOCK, "name", name, NULL));
+
+	self->func = func;
+	self->user_data = user_data;
+	return GST_CLOCK(self);
+}
+
+/*
+ * the system clock time, looked up through the instance: class_init only ran
+ * in the plugin that registered the type, so no static parent_class here
+ */
+static GstClockTime gst_dvbclock_system_time(GstDVBClock *self)
+{
+	GstClockClass *parent = GST_CLOCK_CLASS(g_type_class_peek_parent(G_OBJECT_GET_CLASS(self)));
+
+	return parent->get_internal_time(GST_CLOCK(self));
+}
+
+/* call with the object lock held, returns FALSE when the cached sample is still valid */
+static gboolean gst_dvbclock_sample(GstDVBClock *self, GstClockTime now)
+{
+	GstClockTime position, elapsed;
+
+	if (!GST_CLOCK_TIME_IS_VALID(self->sample_system))
+	{
+		/* first sample, start out at the system time */
+		self->base = now;
+		self->sample_system = now;
+		self->sample_time = self->func ? self->func(GST_CLOCK(self), self->user_data) : GST_CLOCK_TIME_NONE;
+		self->running = TRUE;
+		return TRUE;
+	}
+
+	elapsed = now - self->sample_system;
+	if (elapsed < self->interval) return FALSE;
+
+	position = self->func ? self->func(GST_CLOCK(self), self->user_data) : GST_CLOCK_TIME_NONE;
+	if (GST_CLOCK_TIME_IS_VALID(position) && GST_CLOCK_TIME_IS_VALID(self->sample_time)
+		&& position >= self->sample_time && position - self->sample_time <= elapsed + GST_SECOND)
+	{
+		/* follow the decoder, it does not advance while it is paused */
+		self->base += position - self->sample_time;
+		self->running = position != self->sample_time;
+	}
+	else
+	{
+		/* no decoder time yet or a discontinuity (flush, seek), follow the system clock */
+		if (GST_CLOCK_TIME_IS_VALID(position) && GST_CLOCK_TIME_IS_VALID(self->sample_time))
+		{
+			GST_DEBUG_OBJECT(self, "decoder discontinuity %" GST_TIME_FORMAT " -> %" GST_TIME_FORMAT,
+				GST_TIME_ARGS(self->sample_time), GST_TIME_ARGS(position));
+		}
+		self->base += elapsed;
+		self->running = TRUE;
+		self->last_position = GST_CLOCK_TIME_NONE;
+	}
+	self->sample_time = position;
+	self->sample_system = now;
+	return TRUE;
+}
+
+static GstClockTime gst_dvbclock_get_internal_time(GstClock *clock)
+{
+	GstDVBClock *self = GST_DVBCLOCK(clock);
+	GstClockTime now = gst_dvbclock_system_time(self);
+	GstClockTime result;
+
+	GST_OBJECT_LOCK(self);
+	gst_dvbclock_sample(self, now);
+	/* interpolate between samples, but never run backwards */
+	result = self->base;
+	if (self->running) result += now - self->sample_system;
+	if (result < self->last_time) result = self->last_time;
+	self->last_time = result;
+	GST_OBJECT_UNLOCK(self);
+
+	return result;
+}
+
+/* the decoder position, extrapolated from the last sample */
+GstClockTime gst_dvbclock_get_decoder_time(GstDVBClock *self)
+{
+	GstClockTime now = gst_dvbclock_system_time(self);
+	GstClockTime result;
+
+	GST_OBJECT_LOCK(self);
+	if (gst_dvbclock_sample(self, now))
+		self->misses++;
+	else
+		self->hits++;
+	result = self->sample_time;
+	if (GST_CLOCK_TIME_IS_VALID(result))
+	{
+		if (self->running) result += now - self->sample_system;
+		/* a fresh sample may lag the extrapolated position, do not let it go backwards */
+		if (GST_CLOCK_TIME_IS_VALID(self->last_position) && result < self->last_position) result = self->last_position;
+	}
+	self->last_position = result;
+	GST_OBJECT_UNLOCK(self);
+
+	return result;
+}
+
+/* drop the cached sample, the next request goes to the decoder */
+void gst_dvbclock_reset(GstDVBClock *self)
+{
+	GstClockTime now = gst_dvbclock_system_time(self);
+
+	GST_OBJECT_LOCK(self);
+	if (GST_CLOCK_TIME_IS_VALID(self->sample_system))
+	{
+		/* keep the internal time where it is */
+		if (self->running) self->base += now - self->sample_system;
+		if (self->base < self->last_time) self->base = self->last_time;
+		self->sample_system = now - self->interval;
+		self->running = FALSE;
+	}
+	self->sample_time = GST_CLOCK_TIME_NONE;
+	self->last_position = GST_CLOCK_TIME_NONE;
+	GST_OBJECT_UNLOCK(self);
+}
+
+/* the owner is going away, keep running on the system clock */
+void gst_dvbclock_invalidate(GstDVBClock *self)
+{
+	GST_OBJECT_LOCK(self);
+	self->func = NULL;
+	self->user_data = NULL;
+	GST_OBJECT_UNLOCK(self);
+}
+
+void gst_dvbclock_set_interval(GstDVBClock *self, GstClockTime interval)
+{
+	GST_OBJECT_LOCK(self);
+	self->interval = interval;
+	GST_OBJECT_UNLOCK(self);
+}
+
+GstClockTime gst_dvbclock_get_interval(GstDVBClock *self)
+{
+	GstClockTime interval;
+
+	GST_OBJECT_LOCK(self);
+	interval = self->interval;
+	GST_OBJECT_UNLOCK(self);
+	return interval;
+}
+
+void gst_dvbclock_get_stats(GstDVBClock *self, guint64 *hits, guint64 *misses)
+{
+	GST_OBJECT_LOCK(self);
+	if (hits) *hits = self->hits;
+	if (misses) *misses = self->misses;
+	GST_OBJECT_UNLOCK(self);
+}
@@ -0,0 +1,103 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GST_DVBCLOCK_H__
+#define __GST_DVBCLOCK_H__
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_DVBCLOCK \
+  (gst_dvbclock_get_type())
+#define GST_DVBCLOCK(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_DVBCLOCK,GstDVBClock))
+#define GST_DVBCLOCK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_DVBCLOCK,GstDVBClockClass))
+#define GST_IS_DVBCLOCK(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_DVBCLOCK))
+#define GST_IS_DVBCLOCK_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_DVBCLOCK))
+
+typedef struct _GstDVBClock		GstDVBClock;
+typedef struct _GstDVBClockClass	GstDVBClockClass;
+
+/* returns the current decoder position, or GST_CLOCK_TIME_NONE when the decoder is not running */
+typedef GstClockTime (*GstDVBClockGetTimeFunc) (GstClock *clock, gpointer user_data);
+
+/* default minimum time between two decoder samples */
+#define DVBCLOCK_DEFAULT_INTERVAL (20 * GST_MSECOND)
+
+struct _GstDVBClock
+{
+	GstSystemClock clock;
+
+	GstDVBClockGetTimeFunc func;
+	gpointer user_data;
+
+	GstClockTime interval; /* validity window of a sample */
+	GstClockTime sample_time; /* decoder position of the last sample */
+	GstClockTime sample_system; /* system time of the last sample */
+	GstClockTime base; /* internal time of the last sample */
+	GstClockTime last_time;
+	gboolean running; /* decoder position advanced at the last sample */
+	GstClockTime last_position; /* last decoder position handed out */
+
+	guint64 hits, misses; /* decoder position requests served from the cache or the decoder */
+};
+
+struct _GstDVBClockClass
+{
+	GstSystemClockClass parent_class;
+};
+
+GType gst_dvbclock_get_type (void);
+
+GstClock *gst_dvbclock_new(const gchar *name, GstDVBClockGetTimeFunc func, gpointer user_data);
+GstClockTime gst_dvbclock_get_decoder_time(GstDVBClock *clock);
+void gst_dvbclock_reset(GstDVBClock *clock);
+void gst_dvbclock_invalidate(GstDVBClock *clock);
+void gst_dvbclock_set_interval(GstDVBClock *clock, GstClockTime interval);
+GstClockTime gst_dvbclock_get_interval(GstDVBClock *clock);
+void gst_dvbclock_get_stats(GstDVBClock *clock, guint64 *hits, guint64 *misses);
+
+G_END_DECLS
+
+#endif /* __GST_DVBCLOCK_H__ */
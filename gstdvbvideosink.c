@@ -70,6 +70,7 @@
 #define PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 
 #include "common.h"
+#include "gstdvbclock.h"
 #include "gstdvbvideosink.h"
 #include "gstdvbsink-marshal.h"
 
@@ -159,6 +160,52 @@ enum
 	LAST_SIGNAL
 };
 
+enum
+{
+	PROP_0,
+	PROP_QUEUE_ENTRIES,
+	PROP_QUEUE_BYTES,
+	PROP_RESUME_TIMEOUT,
+	PROP_FAST_ZAP,
+	PROP_WRITER_THREAD,
+	PROP_RING_SIZE,
+	PROP_RING_BYTES,
+	PROP_RING_TIME,
+	PROP_PROVIDE_CLOCK,
+	PROP_POSITION_WINDOW,
+	PROP_POSITION_HITS,
+	PROP_POSITION_MISSES,
+	PROP_SEQUENCE_HEADER_REPARSES,
+	PROP_TRICK_THRESHOLD,
+	PROP_TRICK_REVERSE,
+	PROP_TRICK_DROPPED,
+	PROP_ADAPTER,
+	PROP_STATS,
+	PROP_BUFFER_DEPTH,
+	PROP_DEPTH_INTERVAL,
+	PROP_LIVE_LATENCY,
+	PROP_LIVE_DROPPED,
+	PROP_FAST_EOS,
+	PROP_DECODER,
+	PROP_DEVICE,
+};
+
+#define DEFAULT_RESUME_TIMEOUT 1000
+#define DEFAULT_PROVIDE_CLOCK FALSE
+#define DEFAULT_POSITION_WINDOW 20
+#define DEFAULT_TRICK_THRESHOLD 0.0
+#define DEFAULT_TRICK_REVERSE FALSE
+#define DEFAULT_ADAPTER 0
+/* buffers of a proposed pool, large enough for most frames */
+#define POOL_BUFFER_SIZE (512 * 1024)
+#define DEFAULT_DECODER 0
+#define DEFAULT_BUFFER_DEPTH 0
+#define DEFAULT_DEPTH_INTERVAL 0
+#define DEFAULT_LIVE_LATENCY 0
+#define DEFAULT_FAST_EOS FALSE
+/* longest pause between two key frames in trick mode */
+#define TRICK_MAX_STEP GST_SECOND
+
 static guint gst_dvb_videosink_signals[LAST_SIGNAL] = { 0 };
 
 static GstStaticPadTemplate sink_factory =
@@ -232,6 +279,8 @@ GST_STATIC_PAD_TEMPLATE (
 static void gst_dvbvideosink_init(GstDVBVideoSink *self);
 static void gst_dvbvideosink_dispose(GObject *obj);
 static void gst_dvbvideosink_reset(GObject *obj);
+static void gst_dvbvideosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec);
+static void gst_dvbvideosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec);
 
 #define DEBUG_INIT \
 	GST_DEBUG_CATEGORY_INIT(dvbvideosink_debug, "dvbvideosink", 0, "dvbvideosink element");
@@ -244,10 +293,14 @@ static gboolean gst_dvbvideosink_stop (GstBaseSink * sink);
 static gboolean gst_dvbvideosink_event (GstBaseSink * sink, GstEvent * event);
 static GstFlowReturn gst_dvbvideosink_render (GstBaseSink * sink, GstBuffer * buffer);
 static gboolean gst_dvbvideosink_set_caps (GstBaseSink * sink, GstCaps * caps);
+static gboolean gst_dvbvideosink_propose_allocation(GstBaseSink *sink, GstQuery *query);
 static gboolean gst_dvbvideosink_unlock (GstBaseSink * basesink);
 static gboolean gst_dvbvideosink_unlock_stop (GstBaseSink * basesink);
 static GstStateChangeReturn gst_dvbvideosink_change_state (GstElement * element, GstStateChange transition);
+static GstClock *gst_dvbvideosink_provide_clock (GstElement * element);
 static gint64 gst_dvbvideosink_get_decoder_time (GstDVBVideoSink *self);
+static GstClockTime gst_dvbvideosink_sample_decoder_time (GstClock *clock, gpointer user_data);
+static gboolean gst_dvbvideosink_ring_cancel(gpointer data);
 
 /* initialize the plugin's class */
 static void gst_dvbvideosink_class_init(GstDVBVideoSinkClass *self)
@@ -259,6 +312,8 @@ static void gst_dvbvideosink_class_init(GstDVBVideoSinkClass *self)
 	parent_class = g_type_class_peek_parent(self);
 	gobject_class->finalize = gst_dvbvideosink_reset;
 	gobject_class->dispose = gst_dvbvideosink_dispose;
+	gobject_class->set_property = gst_dvbvideosink_set_property;
+	gobject_class->get_property = gst_dvbvideosink_get_property;
 
 	gst_element_class_add_pad_template(element_class, gst_static_pad_template_get(&sink_factory));
 	gst_element_class_set_static_metadata(element_class,
@@ -274,8 +329,135 @@ static void gst_dvbvideosink_class_init(GstDVBVideoSinkClass *self)
 	gstbasesink_class->unlock = GST_DEBUG_FUNCPTR (gst_dvbvideosink_unlock);
 	gstbasesink_class->unlock_stop = GST_DEBUG_FUNCPTR (gst_dvbvideosink_unlock_stop);
 	gstbasesink_class->set_caps = GST_DEBUG_FUNCPTR (gst_dvbvideosink_set_caps);
+	gstbasesink_class->propose_allocation = GST_DEBUG_FUNCPTR (gst_dvbvideosink_propose_allocation);
 
 	element_class->change_state = GST_DEBUG_FUNCPTR (gst_dvbvideosink_change_state);
+	element_class->provide_clock = GST_DEBUG_FUNCPTR (gst_dvbvideosink_provide_clock);
+
+	g_object_class_install_property(gobject_class, PROP_QUEUE_ENTRIES,
+		g_param_spec_uint("queue-entries", "Queue entries",
+		"Number of buffer ranges waiting to be written to the decoder",
+		0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_QUEUE_BYTES,
+		g_param_spec_uint64("queue-bytes", "Queue bytes",
+		"Number of bytes waiting to be written to the decoder",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RESUME_TIMEOUT,
+		g_param_spec_uint("resume-timeout", "Resume timeout",
+		"Maximum time in ms to wait for the decoder before rendering resumes after a flush",
+		0, G_MAXUINT, DEFAULT_RESUME_TIMEOUT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_FAST_ZAP,
+		g_param_spec_boolean("fast-zap", "Fast zap",
+		"Keep the decoder running on caps changes which do not change the decoder setup",
+		FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_WRITER_THREAD,
+		g_param_spec_boolean("writer-thread", "Writer thread",
+		"Write to the decoder from a separate thread (takes effect on the next start)",
+		FALSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RING_SIZE,
+		g_param_spec_uint("ring-size", "Ring size",
+		"Number of packets the writer thread ring can hold (takes effect on the next start)",
+		1, 1024, PES_RING_DEFAULT_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RING_BYTES,
+		g_param_spec_uint64("ring-bytes", "Ring bytes",
+		"Number of bytes waiting in the writer thread ring",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_RING_TIME,
+		g_param_spec_uint64("ring-time", "Ring time",
+		"Duration of the data waiting in the writer thread ring",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_PROVIDE_CLOCK,
+		g_param_spec_boolean("provide-clock", "Provide clock",
+		"Provide a clock driven by the decoder to the pipeline",
+		DEFAULT_PROVIDE_CLOCK, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POSITION_WINDOW,
+		g_param_spec_uint("position-window", "Position window",
+		"Time in ms a decoder position sample is reused before the decoder is asked again (0 = always ask)",
+		0, 1000, DEFAULT_POSITION_WINDOW, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POSITION_HITS,
+		g_param_spec_uint64("position-hits", "Position hits",
+		"Number of decoder position requests served from the cached sample",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_POSITION_MISSES,
+		g_param_spec_uint64("position-misses", "Position misses",
+		"Number of decoder position requests which had to ask the decoder",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_SEQUENCE_HEADER_REPARSES,
+		g_param_spec_uint64("sequence-header-reparses", "Sequence header reparses",
+		"Number of times a new or changed MPEG-1/2 sequence header was parsed into codec_data",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_TRICK_THRESHOLD,
+		g_param_spec_double("trick-threshold", "Trick threshold",
+		"Playback rate above which only key frames are written, paced by the sink (0 = off, the default, fast forward is left to the decoder)",
+		0.0, 64.0, DEFAULT_TRICK_THRESHOLD, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_TRICK_REVERSE,
+		g_param_spec_boolean("trick-reverse", "Trick reverse",
+		"Play negative rates in trick mode, showing the key frame of each GOP upstream delivers in reverse order",
+		DEFAULT_TRICK_REVERSE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_TRICK_DROPPED,
+		g_param_spec_uint64("trick-dropped", "Trick dropped",
+		"Number of non-key frames dropped in trick mode",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_ADAPTER,
+		g_param_spec_uint("adapter", "Adapter",
+		"DVB adapter number of the video decoder (takes effect on the next start)",
+		0, 255, DEFAULT_ADAPTER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_DECODER,
+		g_param_spec_uint("decoder", "Decoder",
+		"Index of the video decoder on the adapter, for boxes with more than one (takes effect on the next start)",
+		0, 255, DEFAULT_DECODER, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_DEVICE,
+		g_param_spec_string("device", "Device",
+		"Video decoder device node, overrides adapter and decoder when set (takes effect on the next start)",
+		NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_STATS,
+		g_param_spec_boxed("stats", "Statistics",
+		"Counters and histograms of the writes to the video decoder since the last start",
+		GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_BUFFER_DEPTH,
+		g_param_spec_uint("buffer-depth", "Buffer depth",
+		"Hold back upstream while more than this many ms are written ahead of the decoder position (0 = fill the decoder fifo)",
+		0, 60000, DEFAULT_BUFFER_DEPTH, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_DEPTH_INTERVAL,
+		g_param_spec_uint("depth-interval", "Depth interval",
+		"Post a bufferDepth element message at most every this many ms while rendering (0 = never)",
+		0, 60000, DEFAULT_DEPTH_INTERVAL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_LIVE_LATENCY,
+		g_param_spec_uint("live-latency", "Live latency",
+		"Drop non-reference frames while more than this many ms are written ahead of the decoder position (0 = never drop)",
+		0, 60000, DEFAULT_LIVE_LATENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_LIVE_DROPPED,
+		g_param_spec_uint64("live-dropped", "Live dropped",
+		"Number of non-reference frames dropped to keep the live latency",
+		0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+	g_object_class_install_property(gobject_class, PROP_FAST_EOS,
+		g_param_spec_boolean("fast-eos", "Fast EOS",
+		"Finish EOS once the decoder position reaches the last written pts, without waiting for the driver to report an empty buffer",
+		DEFAULT_FAST_EOS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
 	gst_dvb_videosink_signals[SIGNAL_GET_DECODER_TIME] =
 		g_signal_new ("get-decoder-time",
@@ -287,8 +469,6 @@ static void gst_dvbvideosink_class_init(GstDVBVideoSinkClass *self)
 	self->get_decoder_time = gst_dvbvideosink_get_decoder_time;
 }
 
-#define H264_BUFFER_SIZE (64*1024+2048)
-
 /* initialize the new element
  * instantiate pads and add them to element
  * set functions
@@ -298,9 +478,14 @@ static void gst_dvbvideosink_init(GstDVBVideoSink *self)
 {
 	self->must_send_header = TRUE;
 	self->h264_nal_len_size = 0;
-	self->pesheader_buffer = NULL;
+	self->pesheader.buffer = NULL;
+	self->codec_data_map.buffer = NULL;
+	self->caps_codec_data = NULL;
 	self->codec_data = NULL;
+	self->sheader_end_code = 0;
+	self->sheader_reparses = 0;
 	self->codec_type = CT_H264;
+	self->render_codec = NULL;
 	self->stream_type = STREAMTYPE_UNKNOWN;
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 	self->must_pack_bitstream = FALSE;
@@ -312,11 +497,37 @@ static void gst_dvbvideosink_init(GstDVBVideoSink *self)
 	self->pts_written = self->using_dts_downmix = FALSE;
 	self->lastpts = 0;
 	self->timestamp_offset = 0;
-	self->queue = NULL;
+	queue_init(&self->queue);
+	self->resume_timeout = DEFAULT_RESUME_TIMEOUT;
+	self->fast_zap = FALSE;
+	self->writer_thread = FALSE;
+	self->ring_size = PES_RING_DEFAULT_SIZE;
+	memset(&self->ring, 0, sizeof(self->ring));
+	self->writer_error = 0;
 	self->fd = -1;
 	self->unlockfd[0] = self->unlockfd[1] = -1;
 	self->saved_fallback_framerate[0] = 0;
 	self->rate = 1.0;
+	self->dvb_adapter = DEFAULT_ADAPTER;
+	self->dvb_decoder = DEFAULT_DECODER;
+	self->dvb_device = NULL;
+	self->buffer_depth = DEFAULT_BUFFER_DEPTH;
+	self->depth_interval = DEFAULT_DEPTH_INTERVAL;
+	self->live_latency = DEFAULT_LIVE_LATENCY;
+	self->live_dropped = 0;
+	self->fast_eos = DEFAULT_FAST_EOS;
+	self->written_position = self->written_pts = -1;
+	self->depth_reported = 0;
+	self->trick_threshold = DEFAULT_TRICK_THRESHOLD;
+	self->trick_reverse = DEFAULT_TRICK_REVERSE;
+	self->trick_mode = FALSE;
+	self->trick_prev_pts = self->trick_out_pts = GST_CLOCK_TIME_NONE;
+	self->trick_time = 0;
+	self->trick_position = -1;
+	self->trick_dropped = 0;
+	self->clock = gst_dvbclock_new("GstDVBVideoSinkClock", gst_dvbvideosink_sample_decoder_time, self);
+	self->provide_clock = DEFAULT_PROVIDE_CLOCK;
+	if (self->provide_clock) GST_OBJECT_FLAG_SET(self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
 
 	gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
 	gst_base_sink_set_async_enabled(GST_BASE_SINK(self), TRUE);
@@ -330,16 +541,185 @@ static void gst_dvbvideosink_dispose(GObject *obj)
 
 static void gst_dvbvideosink_reset(GObject *obj)
 {
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(obj);
+	queue_free(&self->queue);
+	gst_dvbclock_invalidate(GST_DVBCLOCK(self->clock));
+	gst_object_unref(self->clock);
+	g_free(self->dvb_device);
 	G_OBJECT_CLASS(parent_class)->finalize(obj);
 	GST_INFO("GstDVBVideoSink RESET");
 }
 
+static void gst_dvbvideosink_set_property(GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_RESUME_TIMEOUT:
+		self->resume_timeout = g_value_get_uint(value);
+		break;
+	case PROP_FAST_ZAP:
+		self->fast_zap = g_value_get_boolean(value);
+		break;
+	case PROP_WRITER_THREAD:
+		self->writer_thread = g_value_get_boolean(value);
+		break;
+	case PROP_RING_SIZE:
+		self->ring_size = g_value_get_uint(value);
+		break;
+	case PROP_PROVIDE_CLOCK:
+		GST_OBJECT_LOCK(self);
+		self->provide_clock = g_value_get_boolean(value);
+		if (self->provide_clock)
+			GST_OBJECT_FLAG_SET(self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
+		else
+			GST_OBJECT_FLAG_UNSET(self, GST_ELEMENT_FLAG_PROVIDE_CLOCK);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_POSITION_WINDOW:
+		gst_dvbclock_set_interval(GST_DVBCLOCK(self->clock), g_value_get_uint(value) * GST_MSECOND);
+		break;
+	case PROP_TRICK_THRESHOLD:
+		self->trick_threshold = g_value_get_double(value);
+		break;
+	case PROP_TRICK_REVERSE:
+		self->trick_reverse = g_value_get_boolean(value);
+		break;
+	case PROP_ADAPTER:
+		self->dvb_adapter = g_value_get_uint(value);
+		break;
+	case PROP_DECODER:
+		self->dvb_decoder = g_value_get_uint(value);
+		break;
+	case PROP_DEVICE:
+		g_free(self->dvb_device);
+		self->dvb_device = g_value_dup_string(value);
+		break;
+	case PROP_BUFFER_DEPTH:
+		self->buffer_depth = g_value_get_uint(value);
+		break;
+	case PROP_DEPTH_INTERVAL:
+		self->depth_interval = g_value_get_uint(value);
+		break;
+	case PROP_LIVE_LATENCY:
+		self->live_latency = g_value_get_uint(value);
+		break;
+	case PROP_FAST_EOS:
+		self->fast_eos = g_value_get_boolean(value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
+static void gst_dvbvideosink_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(object);
+
+	switch (prop_id)
+	{
+	case PROP_QUEUE_ENTRIES:
+		GST_OBJECT_LOCK(self);
+		g_value_set_uint(value, self->queue.count);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_QUEUE_BYTES:
+		GST_OBJECT_LOCK(self);
+		g_value_set_uint64(value, self->queue.bytes);
+		GST_OBJECT_UNLOCK(self);
+		break;
+	case PROP_RESUME_TIMEOUT:
+		g_value_set_uint(value, self->resume_timeout);
+		break;
+	case PROP_FAST_ZAP:
+		g_value_set_boolean(value, self->fast_zap);
+		break;
+	case PROP_WRITER_THREAD:
+		g_value_set_boolean(value, self->writer_thread);
+		break;
+	case PROP_RING_SIZE:
+		g_value_set_uint(value, self->ring_size);
+		break;
+	case PROP_RING_BYTES:
+		g_value_set_uint64(value, g_atomic_int_get(&self->ring.bytes));
+		break;
+	case PROP_RING_TIME:
+		g_value_set_uint64(value, (guint64)g_atomic_int_get(&self->ring.time_us) * GST_USECOND);
+		break;
+	case PROP_PROVIDE_CLOCK:
+		g_value_set_boolean(value, self->provide_clock);
+		break;
+	case PROP_POSITION_WINDOW:
+		g_value_set_uint(value, gst_dvbclock_get_interval(GST_DVBCLOCK(self->clock)) / GST_MSECOND);
+		break;
+	case PROP_POSITION_HITS:
+	{
+		guint64 hits;
+		gst_dvbclock_get_stats(GST_DVBCLOCK(self->clock), &hits, NULL);
+		g_value_set_uint64(value, hits);
+		break;
+	}
+	case PROP_POSITION_MISSES:
+	{
+		guint64 misses;
+		gst_dvbclock_get_stats(GST_DVBCLOCK(self->clock), NULL, &misses);
+		g_value_set_uint64(value, misses);
+		break;
+	}
+	case PROP_SEQUENCE_HEADER_REPARSES:
+		g_value_set_uint64(value, self->sheader_reparses);
+		break;
+	case PROP_TRICK_THRESHOLD:
+		g_value_set_double(value, self->trick_threshold);
+		break;
+	case PROP_TRICK_REVERSE:
+		g_value_set_boolean(value, self->trick_reverse);
+		break;
+	case PROP_TRICK_DROPPED:
+		g_value_set_uint64(value, self->trick_dropped);
+		break;
+	case PROP_ADAPTER:
+		g_value_set_uint(value, self->dvb_adapter);
+		break;
+	case PROP_DECODER:
+		g_value_set_uint(value, self->dvb_decoder);
+		break;
+	case PROP_DEVICE:
+		g_value_set_string(value, self->dvb_device);
+		break;
+	case PROP_BUFFER_DEPTH:
+		g_value_set_uint(value, self->buffer_depth);
+		break;
+	case PROP_DEPTH_INTERVAL:
+		g_value_set_uint(value, self->depth_interval);
+		break;
+	case PROP_LIVE_LATENCY:
+		g_value_set_uint(value, self->live_latency);
+		break;
+	case PROP_LIVE_DROPPED:
+		g_value_set_uint64(value, self->live_dropped);
+		break;
+	case PROP_FAST_EOS:
+		g_value_set_boolean(value, self->fast_eos);
+		break;
+	case PROP_STATS:
+		g_value_take_boxed(value, sink_stats_to_structure(&self->stats, "GstDVBVideoSinkStats"));
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+		break;
+	}
+}
+
 #ifdef HAVE_DTSDOWNMIX
 
 #endif
 
-static gint64 gst_dvbvideosink_get_decoder_time(GstDVBVideoSink *self)
+static GstClockTime gst_dvbvideosink_sample_decoder_time(GstClock *clock, gpointer user_data)
 {
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(user_data);
 	gint64 cur = 0;
 	if (self->fd < 0 || !self->playing || !self->pts_written) return GST_CLOCK_TIME_NONE;
 
@@ -355,7 +735,44 @@ static gint64 gst_dvbvideosink_get_decoder_time(GstDVBVideoSink *self)
 	cur *= 11111;
 	cur -= self->timestamp_offset;
 
-	return cur;
+	return cur > 0 ? cur : 0;
+}
+
+/* served from the clock, which only asks the decoder once per sample interval */
+static gint64 gst_dvbvideosink_get_decoder_time(GstDVBVideoSink *self)
+{
+	/* the decoder runs on rescaled timestamps in trick mode */
+	if (self->trick_mode) return self->trick_position;
+	return (gint64)gst_dvbclock_get_decoder_time(GST_DVBCLOCK(self->clock));
+}
+
+static gint64 gst_dvbvideosink_depth(gpointer data)
+{
+	GstDVBVideoSink *self = data;
+	/* the position is rescaled in trick mode */
+	if (self->trick_mode || self->written_position < 0) return -1;
+	return decoder_depth(self->written_position, gst_dvbvideosink_get_decoder_time(self));
+}
+
+/* fast-eos: time until the decoder position reaches the last written pts, 0 once it did, -1 while unknown */
+static gint64 gst_dvbvideosink_drain_estimate(GstDVBVideoSink *self)
+{
+	gint64 position;
+	if (self->written_pts < 0) return -1;
+	position = gst_dvbvideosink_get_decoder_time(self);
+	if (position < 0) return -1;
+	return MAX(self->written_pts - position, 0);
+}
+
+static GstClock *gst_dvbvideosink_provide_clock(GstElement *element)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(element);
+	GstClock *clock = NULL;
+
+	GST_OBJECT_LOCK(self);
+	if (self->provide_clock) clock = GST_CLOCK(gst_object_ref(self->clock));
+	GST_OBJECT_UNLOCK(self);
+	return clock;
 }
 
 static gboolean gst_dvbvideosink_unlock(GstBaseSink *basesink)
@@ -364,6 +781,7 @@ static gboolean gst_dvbvideosink_unlock(GstBaseSink *basesink)
 	self->unlocking = TRUE;
 	/* wakeup the poll */
 	write(self->unlockfd[1], "\x01", 1);
+	if (self->ring.thread) pes_ring_wakeup(&self->ring);
 	GST_DEBUG_OBJECT(basesink, "unlock");
 	return TRUE;
 }
@@ -394,18 +812,21 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 		self->flushing = TRUE;
 		/* wakeup the poll */
 		write(self->unlockfd[1], "\x01", 1);
+		if (self->ring.thread) pes_ring_wakeup(&self->ring);
 		if(self->paused) ret = GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
 		break;
 	case GST_EVENT_FLUSH_STOP:
+		/* the writer drops its packets while flushing, wait until it is done */
+		if (self->ring.thread) pes_ring_wait_idle(&self->ring, NULL, NULL);
 		if (self->fd >= 0) ioctl(self->fd, VIDEO_CLEAR_BUFFER);
+		gst_dvbclock_reset(GST_DVBCLOCK(self->clock));
+		self->written_position = self->written_pts = -1;
 		GST_OBJECT_LOCK(self);
 		self->must_send_header = TRUE;
-		while (self->queue)
-		{
-			queue_pop(&self->queue);
-		}
+		queue_clear(&self->queue);
 		self->flushing = FALSE;
 		GST_OBJECT_UNLOCK(self);
+		self->trick_prev_pts = GST_CLOCK_TIME_NONE;
 		if(self->paused) ret = GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
 		/* flush while media is playing requires a delay before rendering */
 		if (self->using_dts_downmix)
@@ -425,11 +846,29 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 		pfd[1].events = POLLIN;
 
 		GST_BASE_SINK_PREROLL_UNLOCK(sink);
-		while (1)
+		if (self->ring.thread && !pes_ring_wait_idle(&self->ring, gst_dvbvideosink_ring_cancel, self))
+		{
+			GST_DEBUG_OBJECT(self, "wait EOS aborted while draining the writer thread");
+			ret = FALSE;
+		}
+		/* flush start and unlock write to unlockfd, so there is no need to time out */
+		while (ret)
 		{
-			int retval = poll(pfd, 2, 250);
+			int timeout = -1;
+			if (self->fast_eos)
+			{
+				gint64 remaining = gst_dvbvideosink_drain_estimate(self);
+				if (remaining == 0)
+				{
+					GST_DEBUG_OBJECT(self, "decoder reached the last written pts");
+					break;
+				}
+				if (remaining > 0) timeout = MAX(remaining / GST_MSECOND, 1);
+			}
+			int retval = poll(pfd, 2, timeout);
 			if (retval < 0)
 			{
+				if (errno == EINTR) continue;
 				perror("poll in EVENT_EOS");
 				ret = FALSE;
 				break;
@@ -478,10 +917,16 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 		if (format == GST_FORMAT_TIME)
 		{
 			self->timestamp_offset = start - pos;
+			gst_dvbclock_reset(GST_DVBCLOCK(self->clock));
 			if (rate != self->rate)
 			{
 				int skip = 0, repeat = 0;
-				if (rate > 1.0)
+				gboolean trick = (self->trick_threshold > 0.0 && rate > self->trick_threshold) || (self->trick_reverse && rate < 0.0);
+				if (trick)
+				{
+					/* the sink drops and paces frames itself, the decoder plays normally */
+				}
+				else if (rate > 1.0)
 				{
 					skip = (int)rate;
 				}
@@ -493,6 +938,9 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 				ioctl(self->fd, VIDEO_FAST_FORWARD, skip);
 				ioctl(self->fd, VIDEO_CONTINUE);
 				self->rate = rate;
+				if (trick != self->trick_mode) GST_INFO_OBJECT(self, "%s trick mode at rate %f", trick ? "enter" : "leave", rate);
+				self->trick_mode = trick;
+				self->trick_prev_pts = GST_CLOCK_TIME_NONE;
 			}
 		}
 		ret = GST_BASE_SINK_CLASS(parent_class)->event(sink, event);
@@ -545,42 +993,41 @@ static gboolean gst_dvbvideosink_event(GstBaseSink *sink, GstEvent *event)
 	return ret;
 }
 
-static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buffer, size_t start, size_t end)
+static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, pes_packet_t *packet)
 {
-	size_t written = start;
-	size_t len = end;
 	struct pollfd pfd[2];
-	guint8 *data;
 	int retval = 0;
-	GstMapInfo map;
-	gst_buffer_map(buffer, &map, GST_MAP_READ);
-	data = map.data;
 
 	pfd[0].fd = self->unlockfd[0];
 	pfd[0].events = POLLIN;
 	pfd[1].fd = self->fd;
 	pfd[1].events = POLLOUT | POLLPRI;
 
-	do
+	while (packet->size > 0)
 	{
 		if (self->flushing)
 		{
-			GST_INFO_OBJECT(self, "flushing, skip %d bytes", len - written);
+			GST_INFO_OBJECT(self, "flushing, skip %d bytes", packet->size);
 			break;
 		}
 		else if (self->paused || self->unlocking)
 		{
+			size_t queued = packet->size;
 			GST_OBJECT_LOCK(self);
-			queue_push(&self->queue, buffer, written, end);
+			pes_packet_queue(packet, &self->queue);
+			sink_stats_queued(&self->stats, self->queue.bytes);
 			GST_OBJECT_UNLOCK(self);
-			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", len - written);
+			GST_DEBUG_OBJECT(self, "pushed %d bytes to queue", queued);
 			break;
 		}
 		else
 		{
-			GST_DEBUG_OBJECT (self, "going into poll, have %d bytes to write", len - written);
+			GST_DEBUG_OBJECT (self, "going into poll, have %d bytes to write", packet->size);
 		}
-		if (poll(pfd, 2, -1) < 0)
+		gint64 poll_start = g_get_monotonic_time();
+		int polled = poll(pfd, 2, -1);
+		sink_stats_poll(&self->stats, poll_start);
+		if (polled < 0)
 		{
 			if (errno == EINTR) continue;
 			retval = -1;
@@ -653,6 +1100,7 @@ static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buff
 				gst_buffer_map(queuebuffer, &queuemap, GST_MAP_READ);
 				queuedata = queuemap.data;
 				int wr = write(self->fd, queuedata + queuestart, queueend - queuestart);
+				sink_stats_write(&self->stats, wr, queueend - queuestart);
 				gst_buffer_unmap(queuebuffer, &queuemap);
 				if (wr < 0)
 				{
@@ -675,14 +1123,15 @@ static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buff
 				}
 				else
 				{
-					self->queue->start += wr;
+					queue_advance(&self->queue, wr);
 					GST_DEBUG_OBJECT (self, "written %d queue bytes... update offset", wr);
 				}
 				GST_OBJECT_UNLOCK(self);
 				continue;
 			}
 			GST_OBJECT_UNLOCK(self);
-			int wr = write(self->fd, data + written, len - written);
+			int wr = pes_packet_write(packet, self->fd);
+			sink_stats_write(&self->stats, wr, packet->size);
 			if (wr < 0)
 			{
 				switch (errno)
@@ -696,485 +1145,676 @@ static int video_write(GstBaseSink *sink, GstDVBVideoSink *self, GstBuffer *buff
 				}
 				if (retval < 0) break;
 			}
-			written += wr;
+			pes_packet_consume(packet, wr);
+			if (!packet->size) sink_stats_packet(&self->stats, packet);
 		}
-	} while (written < len);
+	}
 
-	gst_buffer_unmap(buffer, &map);
 	return retval;
 }
 
-static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffer)
+static gboolean gst_dvbvideosink_ring_cancel(gpointer data)
 {
-	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
-	guint8 *pes_header;
-	gsize pes_header_len = 0;
-	gsize data_len;
-	guint8 *data, *original_data;
-	guint8 *codec_data = NULL;
-	gsize codec_data_size = 0;
-	gsize payload_len = 0;
-	GstBuffer *tmpbuf = NULL;
-	GstFlowReturn ret = GST_FLOW_OK;
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(data);
+	return self->flushing;
+}
 
-	if (self->fd < 0)
+/* writer thread, takes the packets queued by render and writes them to the decoder */
+static gpointer gst_dvbvideosink_writer(gpointer data)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(data);
+	pes_ring_slot_t *slot;
+	while ((slot = pes_ring_peek(&self->ring)) != NULL)
 	{
-		return GST_FLOW_OK;
+		if (video_write(GST_BASE_SINK(self), self, &slot->packet) < 0)
+		{
+			g_atomic_int_set(&self->writer_error, errno ? errno : EIO);
+		}
+		pes_ring_pop(&self->ring);
 	}
-	gint i = 0;
-	/* WAIT 1 seconds after flush needed for enigma2 to be ready*/
-	while (self->ok_to_write == 0)
-	{
-			self->flushed = FALSE;
-			self->ok_to_write = 1;
-			self->playing = TRUE;
-			gst_sleepms(1000);
-			GST_INFO_OBJECT(self,"RESUME PLAY AFTER FLUSH + 1 SECOND");
-	}
-	GstMapInfo map, pesheadermap, codecdatamap;
-	gst_buffer_map(buffer, &map, GST_MAP_READ);
-	original_data = data = map.data;
-	data_len = map.size;
-	gst_buffer_map(self->pesheader_buffer, &pesheadermap, GST_MAP_WRITE);
-	pes_header = pesheadermap.data;
-	if (self->codec_data)
+	return NULL;
+}
+
+static int gst_dvbvideosink_submit(GstBaseSink *sink, GstDVBVideoSink *self, pes_packet_t *packet, GstClockTime duration)
+{
+	gint error;
+	if (!self->ring.thread) return video_write(sink, self, packet);
+	error = g_atomic_int_get(&self->writer_error);
+	if (error)
 	{
-		gst_buffer_map(self->codec_data, &codecdatamap, GST_MAP_READ);
-		codec_data = codecdatamap.data;
-		codec_data_size = codecdatamap.size;
+		errno = error;
+		return -3;
 	}
+	/* a packet which is dropped because of a flush is no error, just like in video_write */
+	if (pes_ring_push(&self->ring, packet, duration, gst_dvbvideosink_ring_cancel, self) >= 0) return 0;
+	/* too many buffers for a slot, write it from here behind the queued packets */
+	if (!pes_ring_wait_idle(&self->ring, gst_dvbvideosink_ring_cancel, self)) return 0;
+	return video_write(sink, self, packet);
+}
 
-#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
-	gboolean commit_prev_frame_data = FALSE, cache_prev_frame = FALSE;
-#endif
-
-#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
-	if (self->must_pack_bitstream)
+/* Convert AVC length prefixed NALs into Annex-B by adding a start code and a slice
+ * of the original buffer per NAL to packet. With packet NULL, only the size of
+ * the converted data is calculated. */
+static gsize gst_dvbvideosink_h264_to_annexb(GstDVBVideoSink *self, pes_packet_t *packet, GstBuffer *buffer, gsize offset, const guint8 *data, gsize data_len)
+{
+	static const guint8 startcode[3] = { 0x00, 0x00, 0x01 };
+	gsize pos = 0, size = 0;
+	while (pos + self->h264_nal_len_size <= data_len)
 	{
-		cache_prev_frame = TRUE;
-		unsigned int pos = 0;
-		while (pos < data_len)
+		gsize pack_len = 0;
+		int i;
+		for (i = 0; i < self->h264_nal_len_size; i++, pos++)
 		{
-			if (memcmp(&data[pos], "\x00\x00\x01", 3))
-			{
-				pos++;
-				continue;
-			}
-			pos += 3;
-			if ((data[pos++] & 0xF0) == 0x20)
-			{ // we need time_inc_res
-				gboolean low_delay=FALSE;
-				unsigned int ver_id = 1, shape=0, time_inc_res=0, tmp=0;
-				struct bitstream bit;
-				bitstream_init(&bit, data+pos, 0);
-				bitstream_get(&bit, 9);
-				if (bitstream_get(&bit, 1))
-				{
-					ver_id = bitstream_get(&bit, 4); // ver_id
-					bitstream_get(&bit, 3);
-				}
-				if ((tmp = bitstream_get(&bit, 4)) == 15)
-				{ // Custom Aspect Ration
-					bitstream_get(&bit, 8); // skip AR width
-					bitstream_get(&bit, 8); // skip AR height
-				}
-				if (bitstream_get(&bit, 1))
-				{
-					bitstream_get(&bit, 2);
-					low_delay = bitstream_get(&bit, 1) ? TRUE : FALSE;
-					if (bitstream_get(&bit, 1))
-					{
-						bitstream_get(&bit, 32);
-						bitstream_get(&bit, 32);
-						bitstream_get(&bit, 15);
-					}
-				}
-				shape = bitstream_get(&bit, 2);
-				if (ver_id != 1 && shape == 3 /* Grayscale */) bitstream_get(&bit, 4);
-				bitstream_get(&bit, 1);
-				time_inc_res = bitstream_get(&bit, 16);
-				self->time_inc_bits = 0;
-				while (time_inc_res)
-				{ // count bits
-					++self->time_inc_bits;
-					time_inc_res >>= 1;
-				}
-			}
+			pack_len <<= 8;
+			pack_len += data[pos];
 		}
+		if (pack_len > data_len - pos) pack_len = data_len - pos;
+		if (packet)
+		{
+			pes_packet_add(packet, NULL, 0, startcode, sizeof(startcode));
+			pes_packet_add(packet, buffer, offset + pos, data + pos, pack_len);
+		}
+		size += sizeof(startcode) + pack_len;
+		pos += pack_len;
 	}
+	return size;
+}
 
-	if (self->must_pack_bitstream)
+/* prefer the picture coding type where the stream carries one, parsers do not always flag delta units */
+static gboolean gst_dvbvideosink_is_keyframe(GstDVBVideoSink *self, GstBuffer *buffer, start_code_index_t *codes)
+{
+	const guint8 *data = codes->data;
+	gssize pos;
+
+	switch (self->codec_type)
 	{
-		int tmp1, tmp2;
-		unsigned char c1, c2;
-		unsigned int pos = 0;
-		while (pos < data_len)
+	case CT_MPEG1:
+	case CT_MPEG2:
+		/* picture start code, picture_coding_type 1 is an I picture */
+		pos = start_code_find(codes, 0, 0x00);
+		if (pos >= 0 && pos + 5 < codes->size) return ((data[pos + 5] >> 3) & 7) == 1;
+		break;
+	case CT_MPEG4_PART2:
+	case CT_DIVX4:
+		/* vop start code, vop_coding_type 0 is an I-VOP */
+		pos = start_code_find(codes, 0, 0xb6);
+		if (pos >= 0 && pos + 4 < codes->size) return (data[pos + 4] >> 6) == 0;
+		break;
+	default:
+		break;
+	}
+	return !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+}
+
+/* B pictures, and H.264 access units without reference slices, can go without affecting other frames */
+static gboolean gst_dvbvideosink_is_droppable(GstDVBVideoSink *self, GstBuffer *buffer, start_code_index_t *codes)
+{
+	const guint8 *data = codes->data;
+	gssize pos;
+
+	if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DROPPABLE)) return TRUE;
+	switch (self->codec_type)
+	{
+	case CT_MPEG1:
+	case CT_MPEG2:
+		pos = start_code_find(codes, 0, 0x00);
+		return pos >= 0 && pos + 5 < codes->size && ((data[pos + 5] >> 3) & 7) == 3;
+	case CT_MPEG4_PART2:
+	case CT_DIVX4:
+		pos = start_code_find(codes, 0, 0xb6);
+		return pos >= 0 && pos + 4 < codes->size && (data[pos + 4] >> 6) == 2;
+	case CT_H264:
+	{
+		gboolean slices = FALSE;
+		/* length prefixed NALs have no start codes to go by */
+		if (self->h264_nal_len_size) return FALSE;
+		for (pos = start_code_find(codes, 0, -1); pos >= 0 && pos + 3 < codes->size; pos = start_code_find(codes, pos + 3, -1))
 		{
-			if (memcmp(&data[pos], "\x00\x00\x01\xb2", 4))
-			{
-				pos++;
-				continue;
-			}
-			pos += 4;
-			if (data_len - pos < 13) break;
-			if (sscanf((char*)data+pos, "DivX%d%c%d%cp", &tmp1, &c1, &tmp2, &c2) == 4 && (c1 == 'b' || c1 == 'B') && (c2 == 'p' || c2 == 'P')) 
-			{
-				GST_INFO_OBJECT (self, "%s seen... already packed!", (char*)data+pos);
-				self->must_pack_bitstream = FALSE;
-				break;
-			}
+			guint8 nal = data[pos + 3];
+			if ((nal & 0x1f) < 1 || (nal & 0x1f) > 5) continue;
+			/* nal_ref_idc */
+			if (nal & 0x60) return FALSE;
+			slices = TRUE;
 		}
+		return slices;
 	}
-#endif
-	pes_header[0] = 0;
-	pes_header[1] = 0;
-	pes_header[2] = 1;
-	pes_header[3] = 0xE0;
+	default:
+		return FALSE;
+	}
+}
+
+/* live mode: drop non-reference frames while the decoder lags too far behind */
+static gboolean gst_dvbvideosink_live_drop(GstDVBVideoSink *self, GstBuffer *buffer, start_code_index_t *codes)
+{
+	gint64 depth = gst_dvbvideosink_depth(self);
+	if (depth <= (gint64)self->live_latency * GST_MSECOND) return FALSE;
+	if (!gst_dvbvideosink_is_droppable(self, buffer, codes)) return FALSE;
+	self->live_dropped++;
+	GST_DEBUG_OBJECT(self, "%" GST_TIME_FORMAT " ahead of the decoder, drop frame", GST_TIME_ARGS(depth));
+	return TRUE;
+}
 
-	pes_header[6] = 0x81;
-	pes_header[7] = 0; /* no pts */
-	pes_header[8] = 0;
-	pes_header_len = 9;
+/*
+ * trick mode: returns FALSE for frames to drop, waits until key frames are due.
+ * Key frames are spaced by their stream time distance divided by the rate, and get
+ * a rescaled, always increasing pts so the decoder shows them as they arrive.
+ */
+static gboolean gst_dvbvideosink_trick_frame(GstDVBVideoSink *self, GstBuffer *buffer, start_code_index_t *codes)
+{
+	GstClockTime pts = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+	gint64 now;
 
-	if (self->codec_type == CT_VC1 || self->codec_type == CT_VC1_SM)
+	if (!gst_dvbvideosink_is_keyframe(self, buffer, codes))
 	{
-		if (!(GST_BUFFER_FLAGS(buffer) & GST_BUFFER_FLAG_DELTA_UNIT))
+		self->trick_dropped++;
+		return FALSE;
+	}
+	if (!GST_CLOCK_TIME_IS_VALID(pts)) return TRUE;
+
+	now = g_get_monotonic_time();
+	if (GST_CLOCK_TIME_IS_VALID(self->trick_prev_pts))
+	{
+		GstClockTimeDiff distance = GST_CLOCK_DIFF(self->trick_prev_pts, pts);
+		GstClockTime step = (GstClockTime)(ABS(distance) / ABS(self->rate));
+		gint64 due;
+		/* a jump in the stream should not stall the picture */
+		if (step > TRICK_MAX_STEP) step = TRICK_MAX_STEP;
+		due = self->trick_time + (gint64)(step / GST_USECOND);
+		if (due > now && !self->paused && !wait_until(self->unlockfd[0], due))
 		{
-			pes_header[6] = 0x80;
+			GST_DEBUG_OBJECT(self, "trick mode wait interrupted");
+			due = g_get_monotonic_time();
 		}
+		self->trick_time = MAX(due, now);
+		self->trick_out_pts += step;
+	}
+	else
+	{
+		self->trick_time = now;
+		self->trick_out_pts = pts;
 	}
+	self->trick_prev_pts = pts;
+	self->trick_position = MAX((gint64)pts - self->timestamp_offset, 0);
+	return TRUE;
+}
+
+/* the fallback framerate setting of our decoder */
+static FILE *gst_dvbvideosink_open_framerate(GstDVBVideoSink *self, const char *mode)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/stb/vmpeg/%u/fallback_framerate", self->dvb_decoder);
+	return fopen(path, mode);
+}
+
+/* the frame being rendered, handed to the codec handler */
+struct video_frame
+{
+	GstBuffer *buffer;
+	/* writable copy of the input, if the handler needed one */
+	GstBuffer *tmpbuf;
+	GstMapInfo map;
+	guint8 *data;
+	gsize data_len;
+	guint8 *codec_data;
+	gsize codec_data_size;
+	guint8 *pes_header;
+	gsize pes_header_len;
+	start_code_index_t codes;
+	pes_packet_t packet;
+	GstFlowReturn ret;
+};
+
+/* codec handler results */
+enum
+{
+	FRAME_ERROR = -1,
+	FRAME_WRITTEN,
+	/* nothing to account for, the frame was held back or went out with another one */
+	FRAME_DONE,
+};
+
+typedef int (*video_render_func)(GstDVBVideoSink *self, struct video_frame *frame);
+
+/* start the PES header, returns TRUE when it carries a pts */
+static gboolean gst_dvbvideosink_frame_header(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	GstBuffer *buffer = frame->buffer;
+	GstClockTime pts = GST_CLOCK_TIME_NONE;
 
 	if (GST_BUFFER_PTS_IS_VALID(buffer) || (self->use_dts && GST_BUFFER_DTS_IS_VALID(buffer)))
 	{
-		pes_header[7] = 0x80; /* pts */
-		pes_header[8] = 5; /* pts size */
-		pes_header_len += 5;
-		pes_set_pts(GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer), pes_header);
+		if (self->trick_mode)
+			pts = self->trick_out_pts;
+		else
+			pts = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+	}
+	frame->pes_header_len = pes_template_apply(&self->pes_template, frame->pes_header, pts, frame->data_len);
+	return pts != GST_CLOCK_TIME_NONE;
+}
 
-		if (self->codec_data)
+/* codec_data goes in the header of the first frame with a pts */
+static void gst_dvbvideosink_frame_codec_data(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	if (!self->must_send_header) return;
+	memcpy(frame->pes_header + frame->pes_header_len, frame->codec_data, frame->codec_data_size);
+	frame->pes_header_len += frame->codec_data_size;
+	self->must_send_header = FALSE;
+}
+
+/* finish the header for data_len bytes behind it and add it to the packet */
+static void gst_dvbvideosink_frame_add_header(struct video_frame *frame, gsize data_len)
+{
+	pes_set_payload_size(data_len + frame->pes_header_len - 6, frame->pes_header);
+	pes_packet_add(&frame->packet, NULL, 0, frame->pes_header, frame->pes_header_len);
+}
+
+static int gst_dvbvideosink_frame_submit(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	if (gst_dvbvideosink_submit(GST_BASE_SINK(self), self, &frame->packet, GST_BUFFER_DURATION(frame->buffer)) < 0) return FRAME_ERROR;
+	return FRAME_WRITTEN;
+}
+
+/* the frame data as it is, behind the header */
+static int gst_dvbvideosink_frame_write(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	gst_dvbvideosink_frame_add_header(frame, frame->data_len);
+	pes_packet_add(&frame->packet, frame->buffer, 0, frame->data, frame->data_len);
+	return gst_dvbvideosink_frame_submit(self, frame);
+}
+
+static int gst_dvbvideosink_render_mpeg(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	const guint8 *data = frame->data;
+	gsize data_len = frame->data_len;
+
+	gst_dvbvideosink_frame_header(self, frame);
+
+	/*
+	 * broadcast streams repeat the sequence header, only parse it again
+	 * when the bytes up to and including the start code ending it differ
+	 */
+	if (data_len > 3 && !memcmp(data, "\x00\x00\x01\xb3", 4)
+		&& !(self->codec_data && data_len > frame->codec_data_size + 3
+		&& !memcmp(data, frame->codec_data, frame->codec_data_size)
+		&& !memcmp(data + frame->codec_data_size, "\x00\x00\x01", 3)
+		&& data[frame->codec_data_size + 3] == self->sheader_end_code))
+	{
+		gboolean ok = TRUE;
+		unsigned int pos = 4;
+		unsigned int sheader_data_len = 0;
+		while (pos < data_len && ok)
 		{
-			if (self->must_send_header)
+			if (pos >= data_len) break;
+			pos += 7;
+			if (pos >=data_len) break;
+			sheader_data_len = 12;
+			if (data[pos] & 2)
+			{ // intra matrix
+				pos += 64;
+				if (pos >=data_len) break;
+				sheader_data_len += 64;
+			}
+			if (data[pos] & 1)
+			{ // non intra matrix
+				pos += 64;
+				if (pos >=data_len) break;
+				sheader_data_len += 64;
+			}
+			pos += 1;
+			if (pos + 3 >=data_len) break;
+			if (!memcmp(&data[pos], "\x00\x00\x01\xb5", 4))
 			{
-				if (self->codec_type != CT_MPEG1 && self->codec_type != CT_MPEG2 && (self->codec_type != CT_DIVX4 || data[3] == 0x00))
+				// extended start code
+				/* skip to the next start code */
+				gssize next = start_code_find(&frame->codes, pos + 4, -1);
+				if (next < 0)
 				{
-					if (self->codec_type == CT_DIVX311)
-					{
-						video_write(sink, self, self->codec_data, 0, codec_data_size);
-					}
-					else
-					{
-						memcpy(pes_header + pes_header_len, codec_data, codec_data_size);
-						pes_header_len += codec_data_size;
-					}
-					self->must_send_header = FALSE;
+					ok = FALSE;
+					break;
 				}
+				sheader_data_len += next - pos;
+				pos = next;
 			}
-			if (self->codec_type == CT_H264)
+			if (pos + 3 >= data_len) break;
+			if (!memcmp(&data[pos], "\x00\x00\x01\xb2", 4))
 			{
-				unsigned int pos = 0;
-				if (self->h264_nal_len_size >= 3)
+				// private data
+				/* skip to the next start code */
+				gssize next = start_code_find(&frame->codes, pos + 4, -1);
+				if (next < 0)
 				{
-					/* we need to write to the buffer */
-					gst_buffer_unmap(buffer, &map);
-					if (!gst_buffer_is_writable(buffer))
-					{
-						/* buffer is not writable, create a new buffer to which we can write */
-						buffer = tmpbuf = gst_buffer_copy(buffer);
-					}
-					gst_buffer_map(buffer, &map, GST_MAP_READ | GST_MAP_WRITE);
-					original_data = data = map.data;
-					data_len = map.size;
-					while (1)
-					{
-						unsigned int pack_len = 0;
-						int i;
-						for (i = 0; i < self->h264_nal_len_size; i++, pos++)
-						{
-							pack_len <<= 8;
-							pack_len += data[pos];
-							/* replace the lenght field with \x00..\x00\x01 */
-							data[pos] = (i == self->h264_nal_len_size - 1) ? 1 : 0;
-						}
-						if ((pos + pack_len) >= data_len) break;
-						pos += pack_len;
-					}
-				}
-				else
-				{
-					/* length field too small to insert \x00\x00\x01, so we need to copy everything into a second buffer */
-					unsigned char *dest;
-					unsigned int dest_pos = 0;
-					/* TODO: predict needed size, based on data_len and h264_nal_len_size, and number of frames */
-					tmpbuf = gst_buffer_new_and_alloc(H264_BUFFER_SIZE);
-					GstMapInfo tmpmap;
-					gst_buffer_map(tmpbuf, &tmpmap, GST_MAP_READ | GST_MAP_WRITE);
-					dest = tmpmap.data;
-					while (1)
-					{
-						unsigned int pack_len = 0;
-						int i;
-						for (i = 0; i < self->h264_nal_len_size; i++, pos++)
-						{
-							pack_len <<= 8;
-							pack_len += data[pos];
-						}
-						memcpy(dest + dest_pos, "\x00\x00\x01", 3);
-						dest_pos += 3;
-						memcpy(dest + dest_pos, data + pos, pack_len);
-						dest_pos += pack_len;
-						if ((pos + pack_len) >= data_len) break;
-						pos += pack_len;
-					}
-					/* switch to the h264 buffer, where we copied the original render buffer contents */
-					gst_buffer_unmap(buffer, &map);
-					gst_buffer_unmap(tmpbuf, &tmpmap);
-					buffer = tmpbuf;
-					gst_buffer_map(buffer, &map, GST_MAP_READ);
-					original_data = data = map.data;
-					data_len = dest_pos;
+					ok = FALSE;
+					break;
 				}
+				sheader_data_len += next - pos;
+				pos = next;
 			}
-			else if (self->codec_type == CT_MPEG4_PART2)
+			/* the start code which ends the header has to be complete */
+			if (pos + 3 >= data_len) break;
+			if (self->codec_data)
 			{
-				if (memcmp(data, "\x00\x00\x01", 3))
-				{
-					memcpy(pes_header + pes_header_len, "\x00\x00\x01", 3);
-					pes_header_len += 3;
-				}
+				GST_DEBUG_OBJECT(self, "sequence header changed");
+				mapped_buffer_release(&self->codec_data_map);
+				gst_buffer_unref(self->codec_data);
 			}
-			else if (self->codec_type == CT_DIVX311)
+			self->sheader_reparses++;
+			self->sheader_end_code = data[pos + 3];
+			self->codec_data = gst_buffer_new_and_alloc(sheader_data_len);
+			if (self->codec_data)
 			{
-				if (memcmp(data, "\x00\x00\x01\xb6", 4))
-				{
-					memcpy(pes_header + pes_header_len, "\x00\x00\x01\xb6", 4);
-					pes_header_len += 4;
-				}
+				gst_buffer_fill(self->codec_data, 0, data + pos - sheader_data_len, sheader_data_len);
+				mapped_buffer_set(&self->codec_data_map, self->codec_data);
+				frame->codec_data = self->codec_data_map.map.data;
+				frame->codec_data_size = self->codec_data_map.map.size;
 			}
+			self->must_send_header = FALSE;
+			break;
+		}
+	}
+	else if (self->codec_data && self->must_send_header)
+	{
+		/* find group start code */
+		gssize pos = start_code_find(&frame->codes, 0, 0xb8);
+		if (pos >= 0)
+		{
+			gst_dvbvideosink_frame_add_header(frame, data_len + frame->codec_data_size);
+			pes_packet_add(&frame->packet, frame->buffer, 0, data, pos);
+			pes_packet_add(&frame->packet, self->codec_data, 0, frame->codec_data, frame->codec_data_size);
+			pes_packet_add(&frame->packet, frame->buffer, pos, data + pos, data_len - pos);
+			if (gst_dvbvideosink_frame_submit(self, frame) < 0) return FRAME_ERROR;
+			self->must_send_header = FALSE;
+			return FRAME_WRITTEN;
 		}
 	}
+	return gst_dvbvideosink_frame_write(self, frame);
+}
 
-#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
-	if (self->must_pack_bitstream)
+static int gst_dvbvideosink_render_h264(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	gsize annexb_len = 0;
+
+	if (gst_dvbvideosink_frame_header(self, frame) && self->codec_data)
 	{
-		unsigned int pos = 0;
-		gboolean i_frame = FALSE;
-		while (pos < data_len)
+		gst_dvbvideosink_frame_codec_data(self, frame);
+		if (self->h264_nal_len_size >= 3)
 		{
-			if (memcmp(&data[pos], "\x00\x00\x01\xb6", 4))
+			unsigned int pos = 0;
+			guint8 *data;
+			/* we need to write to the buffer */
+			gst_buffer_unmap(frame->buffer, &frame->map);
+			if (!gst_buffer_is_writable(frame->buffer))
 			{
-				pos++;
-				continue;
+				/* buffer is not writable, create a new buffer to which we can write */
+				frame->buffer = frame->tmpbuf = gst_buffer_copy(frame->buffer);
 			}
-			pos += 4;
-			switch ((data[pos] & 0xC0) >> 6)
+			gst_buffer_map(frame->buffer, &frame->map, GST_MAP_READ | GST_MAP_WRITE);
+			data = frame->data = frame->map.data;
+			frame->data_len = frame->map.size;
+			start_code_index_free(&frame->codes);
+			start_code_index_init(&frame->codes, frame->data, frame->data_len);
+			while (1)
 			{
-				case 0: // I-Frame
-					cache_prev_frame = FALSE;
-					i_frame = TRUE;
-				case 1: // P-Frame
-					if (self->prev_frame != buffer)
-					{
-						struct bitstream bit;
-						gboolean store_frame=FALSE;
-						if (self->prev_frame)
-						{
-							if (!self->num_non_keyframes)
-							{
-								ret = gst_dvbvideosink_render(sink, self->prev_frame);
-								gst_buffer_unref(self->prev_frame);
-								self->prev_frame = NULL;
-								if (ret != GST_FLOW_OK)
-									goto error;
-								store_frame = TRUE;
-							}
-							else
-							{
-								pes_header[pes_header_len++] = 0;
-								pes_header[pes_header_len++] = 0;
-								pes_header[pes_header_len++] = 1;
-								pes_header[pes_header_len++] = 0xB6;
-								bitstream_init(&bit, pes_header+pes_header_len, 1);
-								bitstream_put(&bit, 1, 2);
-								bitstream_put(&bit, 0, 1);
-								bitstream_put(&bit, 1, 1);
-								bitstream_put(&bit, self->time_inc, self->time_inc_bits);
-								bitstream_put(&bit, 1, 1);
-								bitstream_put(&bit, 0, 1);
-								bitstream_put(&bit, 0x7F >> bit.avail, 8 - bit.avail);
-								data_len = 0;
-								pes_header_len += bit.data - (pes_header+pes_header_len);
-								cache_prev_frame = TRUE;
-							}
-						}
-						else if (!i_frame)
-						{
-							store_frame = TRUE;
-						}
+				unsigned int pack_len = 0;
+				int i;
+				for (i = 0; i < self->h264_nal_len_size; i++, pos++)
+				{
+					pack_len <<= 8;
+					pack_len += data[pos];
+					/* replace the lenght field with \x00..\x00\x01 */
+					data[pos] = (i == self->h264_nal_len_size - 1) ? 1 : 0;
+				}
+				if ((pos + pack_len) >= frame->data_len) break;
+				pos += pack_len;
+			}
+		}
+		else
+		{
+			/* length field too small to insert \x00\x00\x01, the NALs are written as separate slices behind their start codes */
+			annexb_len = gst_dvbvideosink_h264_to_annexb(self, NULL, NULL, 0, frame->data, frame->data_len);
+		}
+	}
 
-						self->num_non_keyframes=0;
+	if (!annexb_len) return gst_dvbvideosink_frame_write(self, frame);
+	gst_dvbvideosink_frame_add_header(frame, annexb_len);
+	gst_dvbvideosink_h264_to_annexb(self, &frame->packet, frame->buffer, 0, frame->data, frame->data_len);
+	return gst_dvbvideosink_frame_submit(self, frame);
+}
 
-						// extract time_inc
-						bitstream_init(&bit, data+pos, 0);
-						bitstream_get(&bit, 2); // skip coding_type
-						while (bitstream_get(&bit, 1));
-						bitstream_get(&bit, 1);
-						self->time_inc = bitstream_get(&bit, self->time_inc_bits);
+static void gst_dvbvideosink_mpeg4_header(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	if (gst_dvbvideosink_frame_header(self, frame) && self->codec_data)
+	{
+		gst_dvbvideosink_frame_codec_data(self, frame);
+		if (memcmp(frame->data, "\x00\x00\x01", 3))
+		{
+			memcpy(frame->pes_header + frame->pes_header_len, "\x00\x00\x01", 3);
+			frame->pes_header_len += 3;
+		}
+	}
+}
 
-						if (store_frame)
-						{
-							self->prev_frame = buffer;
-							gst_buffer_ref(buffer);
-							goto ok;
-						}
-					}
-					else
-					{
-						cache_prev_frame = FALSE;
-					}
-					break;
-				case 3: // S-Frame
-				case 2: // B-Frame
-					if (++self->num_non_keyframes == 1 && self->prev_frame)
-					{
-						commit_prev_frame_data = TRUE;
-					}
-					break;
-				case 4: // N-Frame
-				default:
-					g_warning("unhandled divx5/xvid frame type %d\n", (data[pos] & 0xC0) >> 6);
-					break;
-			}
+static int gst_dvbvideosink_render_mpeg4(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	gst_dvbvideosink_mpeg4_header(self, frame);
+	return gst_dvbvideosink_frame_write(self, frame);
+}
+
+static int gst_dvbvideosink_render_divx311(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	if (gst_dvbvideosink_frame_header(self, frame) && self->codec_data)
+	{
+		if (self->must_send_header)
+		{
+			/* written as it is, ahead of the first PES packet */
+			pes_packet_add(&frame->packet, self->codec_data, 0, frame->codec_data, frame->codec_data_size);
+			self->must_send_header = FALSE;
+		}
+		if (memcmp(frame->data, "\x00\x00\x01\xb6", 4))
+		{
+			memcpy(frame->pes_header + frame->pes_header_len, "\x00\x00\x01\xb6", 4);
+			frame->pes_header_len += 4;
 		}
 	}
-#endif
+	return gst_dvbvideosink_frame_write(self, frame);
+}
 
-	payload_len = data_len + pes_header_len - 6;
+static int gst_dvbvideosink_render_vc1(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	if (gst_dvbvideosink_frame_header(self, frame) && self->codec_data)
+	{
+		gst_dvbvideosink_frame_codec_data(self, frame);
+	}
+	/* set on every frame, the header buffer keeps the template between packets */
+	frame->pes_header[6] = (GST_BUFFER_FLAGS(frame->buffer) & GST_BUFFER_FLAG_DELTA_UNIT) ? 0x81 : 0x80;
+	memcpy(frame->pes_header + frame->pes_header_len, "\x00\x00\x01\x0d", 4);
+	frame->pes_header_len += 4;
+	return gst_dvbvideosink_frame_write(self, frame);
+}
 
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
-	if (self->prev_frame && self->prev_frame != buffer)
+/* mpeg4 part 2 with unpacked b-frames, each packet needs to carry a single vop */
+static int gst_dvbvideosink_render_divx5(GstDVBVideoSink *self, struct video_frame *frame)
+{
+	GstBuffer *buffer = frame->buffer;
+	guint8 *data = frame->data;
+	gsize data_len = frame->data_len;
+	guint8 *pes_header = frame->pes_header;
+	gboolean commit_prev_frame_data = FALSE, cache_prev_frame = TRUE;
+	GstMapInfo prevframemap;
+	unsigned int pos = 0;
+	gboolean i_frame = FALSE;
+	gssize code;
+	int tmp1, tmp2;
+	unsigned char c1, c2;
+	int written;
+
+	while ((code = start_code_find(&frame->codes, pos, -1)) >= 0 && code + 3 < data_len)
 	{
-		pes_set_pts(GST_BUFFER_PTS_IS_VALID(self->prev_frame) ? GST_BUFFER_PTS(self->prev_frame) : GST_BUFFER_DTS(self->prev_frame), pes_header);
+		pos = code + 3;
+		if ((data[pos++] & 0xF0) == 0x20)
+		{ // we need time_inc_res
+			gboolean low_delay=FALSE;
+			unsigned int ver_id = 1, shape=0, time_inc_res=0, tmp=0;
+			struct bitstream bit;
+			bitstream_init(&bit, data+pos, 0);
+			bitstream_get(&bit, 9);
+			if (bitstream_get(&bit, 1))
+			{
+				ver_id = bitstream_get(&bit, 4); // ver_id
+				bitstream_get(&bit, 3);
+			}
+			if ((tmp = bitstream_get(&bit, 4)) == 15)
+			{ // Custom Aspect Ration
+				bitstream_get(&bit, 8); // skip AR width
+				bitstream_get(&bit, 8); // skip AR height
+			}
+			if (bitstream_get(&bit, 1))
+			{
+				bitstream_get(&bit, 2);
+				low_delay = bitstream_get(&bit, 1) ? TRUE : FALSE;
+				if (bitstream_get(&bit, 1))
+				{
+					bitstream_get(&bit, 32);
+					bitstream_get(&bit, 32);
+					bitstream_get(&bit, 15);
+				}
+			}
+			shape = bitstream_get(&bit, 2);
+			if (ver_id != 1 && shape == 3 /* Grayscale */) bitstream_get(&bit, 4);
+			bitstream_get(&bit, 1);
+			time_inc_res = bitstream_get(&bit, 16);
+			self->time_inc_bits = 0;
+			while (time_inc_res)
+			{ // count bits
+				++self->time_inc_bits;
+				time_inc_res >>= 1;
+			}
+		}
 	}
 
-	if (commit_prev_frame_data)
+	pos = 0;
+	while ((code = start_code_find(&frame->codes, pos, 0xb2)) >= 0)
 	{
-		payload_len += gst_buffer_get_size(self->prev_frame);
+		pos = code + 4;
+		if (data_len - pos < 13) break;
+		if (sscanf((char*)data+pos, "DivX%d%c%d%cp", &tmp1, &c1, &tmp2, &c2) == 4 && (c1 == 'b' || c1 == 'B') && (c2 == 'p' || c2 == 'P')) 
+		{
+			GST_INFO_OBJECT (self, "%s seen... already packed!", (char*)data+pos);
+			self->must_pack_bitstream = FALSE;
+			if (self->prev_frame)
+			{
+				gst_buffer_unref(self->prev_frame);
+				self->prev_frame = NULL;
+			}
+			self->render_codec = gst_dvbvideosink_render_mpeg4;
+			return gst_dvbvideosink_render_mpeg4(self, frame);
+		}
 	}
-#endif
 
-	if (self->codec_type == CT_MPEG2 || self->codec_type == CT_MPEG1)
+	gst_dvbvideosink_mpeg4_header(self, frame);
+
+	pos = 0;
+	while (pos < data_len && (code = start_code_find(&frame->codes, pos, 0xb6)) >= 0 && code + 4 < data_len)
 	{
-		if (!self->codec_data && data_len > 3 && !memcmp(data, "\x00\x00\x01\xb3", 4))
+		pos = code + 4;
+		switch ((data[pos] & 0xC0) >> 6)
 		{
-			gboolean ok = TRUE;
-			unsigned int pos = 4;
-			unsigned int sheader_data_len = 0;
-			while (pos < data_len && ok)
-			{
-				if (pos >= data_len) break;
-				pos += 7;
-				if (pos >=data_len) break;
-				sheader_data_len = 12;
-				if (data[pos] & 2)
-				{ // intra matrix
-					pos += 64;
-					if (pos >=data_len) break;
-					sheader_data_len += 64;
-				}
-				if (data[pos] & 1)
-				{ // non intra matrix
-					pos += 64;
-					if (pos >=data_len) break;
-					sheader_data_len += 64;
-				}
-				pos += 1;
-				if (pos + 3 >=data_len) break;
-				if (!memcmp(&data[pos], "\x00\x00\x01\xb5", 4))
+			case 0: // I-Frame
+				cache_prev_frame = FALSE;
+				i_frame = TRUE;
+			case 1: // P-Frame
+				if (self->prev_frame != buffer)
 				{
-					// extended start code
-					pos += 3;
-					sheader_data_len += 3;
-					do
+					struct bitstream bit;
+					gboolean store_frame=FALSE;
+					if (self->prev_frame)
 					{
-						pos += 1;
-						++sheader_data_len;
-						if (pos + 2 > data_len)
+						if (!self->num_non_keyframes)
 						{
-							ok = FALSE;
-							break;
+							frame->ret = gst_dvbvideosink_render(GST_BASE_SINK(self), self->prev_frame);
+							gst_buffer_unref(self->prev_frame);
+							self->prev_frame = NULL;
+							if (frame->ret != GST_FLOW_OK)
+								return FRAME_ERROR;
+							store_frame = TRUE;
 						}
-					} while (memcmp(&data[pos], "\x00\x00\x01", 3));
-					if (!ok) break;
-				}
-				if (pos + 3 >= data_len) break;
-				if (!memcmp(&data[pos], "\x00\x00\x01\xb2", 4))
-				{
-					// private data
-					pos += 3;
-					sheader_data_len += 3;
-					do
-					{
-						pos += 1;
-						++sheader_data_len;
-						if (pos + 2 > data_len)
+						else
 						{
-							ok = FALSE;
-							break;
+							pes_header[frame->pes_header_len++] = 0;
+							pes_header[frame->pes_header_len++] = 0;
+							pes_header[frame->pes_header_len++] = 1;
+							pes_header[frame->pes_header_len++] = 0xB6;
+							bitstream_init(&bit, pes_header+frame->pes_header_len, 1);
+							bitstream_put(&bit, 1, 2);
+							bitstream_put(&bit, 0, 1);
+							bitstream_put(&bit, 1, 1);
+							bitstream_put(&bit, self->time_inc, self->time_inc_bits);
+							bitstream_put(&bit, 1, 1);
+							bitstream_put(&bit, 0, 1);
+							bitstream_put(&bit, 0x7F >> bit.avail, 8 - bit.avail);
+							frame->data_len = 0;
+							frame->pes_header_len += bit.data - (pes_header+frame->pes_header_len);
+							cache_prev_frame = TRUE;
 						}
-					} while (memcmp(&data[pos], "\x00\x00\x01", 3));
-					if (!ok) break;
+					}
+					else if (!i_frame)
+					{
+						store_frame = TRUE;
+					}
+
+					self->num_non_keyframes=0;
+
+					// extract time_inc
+					bitstream_init(&bit, data+pos, 0);
+					bitstream_get(&bit, 2); // skip coding_type
+					while (bitstream_get(&bit, 1));
+					bitstream_get(&bit, 1);
+					self->time_inc = bitstream_get(&bit, self->time_inc_bits);
+
+					if (store_frame)
+					{
+						self->prev_frame = buffer;
+						gst_buffer_ref(buffer);
+						return FRAME_DONE;
+					}
 				}
-				self->codec_data = gst_buffer_new_and_alloc(sheader_data_len);
-				if (self->codec_data)
+				else
 				{
-					gst_buffer_map(self->codec_data, &codecdatamap, GST_MAP_READ | GST_MAP_WRITE);
-					codec_data = codecdatamap.data;
-					codec_data_size = codecdatamap.size;
-					memcpy(codec_data, data + pos - sheader_data_len, sheader_data_len);
+					cache_prev_frame = FALSE;
 				}
-				self->must_send_header = FALSE;
 				break;
-			}
-		}
-		else if (self->codec_data && self->must_send_header)
-		{
-			int pos = 0;
-			while (pos <= data_len - 4)
-			{
-				if (memcmp(&data[pos], "\x00\x00\x01\xb8", 4)) /* find group start code */
+			case 3: // S-Frame
+			case 2: // B-Frame
+				if (++self->num_non_keyframes == 1 && self->prev_frame)
 				{
-					pos++;
-					continue;
+					commit_prev_frame_data = TRUE;
 				}
-				payload_len += codec_data_size;
-				pes_set_payload_size(payload_len, pes_header);
-				if (video_write(sink, self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
-				if (video_write(sink, self, buffer, data - original_data, (data - original_data) + pos) < 0) goto error;
-				if (video_write(sink, self, self->codec_data, 0, codec_data_size) < 0) goto error;
-				if (video_write(sink, self, buffer, data - original_data + pos, (data - original_data) + data_len - pos) < 0) goto error;
-				self->must_send_header = FALSE;
-				goto ok;
-			}
+				break;
+			case 4: // N-Frame
+			default:
+				g_warning("unhandled divx5/xvid frame type %d\n", (data[pos] & 0xC0) >> 6);
+				break;
 		}
 	}
-	else if (self->codec_type == CT_VC1 || self->codec_type == CT_VC1_SM)
+
+	if (self->prev_frame && self->prev_frame != buffer)
 	{
-		memcpy(pes_header + pes_header_len, "\x00\x00\x01\x0d", 4);
-		pes_header_len += 4;
-		payload_len += 4;
+		pes_set_pts(GST_BUFFER_PTS_IS_VALID(self->prev_frame) ? GST_BUFFER_PTS(self->prev_frame) : GST_BUFFER_DTS(self->prev_frame), pes_header);
 	}
 
-	pes_set_payload_size(payload_len, pes_header);
-
-	if (video_write(sink, self, self->pesheader_buffer, 0, pes_header_len) < 0) goto error;
-
-#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
+	gst_dvbvideosink_frame_add_header(frame, frame->data_len + (commit_prev_frame_data ? gst_buffer_get_size(self->prev_frame) : 0));
 	if (commit_prev_frame_data)
 	{
-		gsize prev_frame_size;
-		prev_frame_size = gst_buffer_get_size(self->prev_frame);
-		if (video_write(sink, self, self->prev_frame, 0, prev_frame_size) < 0) goto error;
+		gst_buffer_map(self->prev_frame, &prevframemap, GST_MAP_READ);
+		pes_packet_add(&frame->packet, self->prev_frame, 0, prevframemap.data, prevframemap.size);
 	}
+	pes_packet_add(&frame->packet, buffer, 0, data, frame->data_len);
+	written = gst_dvbvideosink_submit(GST_BASE_SINK(self), self, &frame->packet, GST_BUFFER_DURATION(buffer));
+	if (commit_prev_frame_data)
+	{
+		gst_buffer_unmap(self->prev_frame, &prevframemap);
+	}
+	if (written < 0) return FRAME_ERROR;
 
 	if (self->prev_frame && self->prev_frame != buffer)
 	{
@@ -1187,35 +1827,108 @@ static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffe
 		gst_buffer_ref(buffer);
 		self->prev_frame = buffer;
 	}
+	return FRAME_WRITTEN;
+}
 #endif
-	if (video_write(sink, self, buffer, data - original_data, (data - original_data) + data_len) < 0) goto error;
 
-	if (GST_BUFFER_PTS_IS_VALID(buffer) || (self->use_dts && GST_BUFFER_DTS_IS_VALID(buffer)))
+/* picked in set_caps, so a frame only runs the code of its own codec */
+static const video_render_func video_render_codecs[] =
+{
+	[CT_MPEG1] = gst_dvbvideosink_render_mpeg,
+	[CT_MPEG2] = gst_dvbvideosink_render_mpeg,
+	[CT_H264] = gst_dvbvideosink_render_h264,
+	[CT_DIVX311] = gst_dvbvideosink_render_divx311,
+	[CT_MPEG4_PART2] = gst_dvbvideosink_render_mpeg4,
+	[CT_VC1] = gst_dvbvideosink_render_vc1,
+	[CT_VC1_SM] = gst_dvbvideosink_render_vc1,
+};
+
+static void gst_dvbvideosink_select_render(GstDVBVideoSink *self)
+{
+	/* the video header has no stream specific data, codec_data only goes with the first frame */
+	pes_template_init(&self->pes_template, 0xE0);
+	self->render_codec = video_render_codecs[self->codec_type];
+#ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
+	if (self->must_pack_bitstream) self->render_codec = gst_dvbvideosink_render_divx5;
+#endif
+}
+
+static GstFlowReturn gst_dvbvideosink_render(GstBaseSink *sink, GstBuffer *buffer)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+	struct video_frame frame;
+	int result;
+
+	if (self->fd < 0)
 	{
-		self->pts_written = TRUE;
+		return GST_FLOW_OK;
+	}
+	if (!self->render_codec)
+	{
+		GST_ELEMENT_ERROR(self, STREAM, FORMAT, (NULL), ("hardware decoder not setup (no caps in pipeline?)"));
+		return GST_FLOW_ERROR;
+	}
+	/* after a flush, wait until the decoder is ready (at most resume-timeout ms) */
+	if (self->ok_to_write == 0)
+	{
+		self->flushed = FALSE;
+		self->ok_to_write = 1;
+		self->playing = TRUE;
+		wait_decoder_ready(self->fd, self->unlockfd[0], self->resume_timeout);
+		GST_INFO_OBJECT(self, "resume play after flush");
+	}
+	decoder_throttle(GST_ELEMENT(self), self->unlockfd[0], gst_dvbvideosink_depth, self, self->buffer_depth,
+		self->depth_interval, &self->depth_reported, !self->paused && !self->flushing && !self->unlocking);
+	frame.buffer = buffer;
+	frame.tmpbuf = NULL;
+	frame.ret = GST_FLOW_OK;
+	pes_packet_init(&frame.packet);
+	gst_buffer_map(buffer, &frame.map, GST_MAP_READ);
+	frame.data = frame.map.data;
+	frame.data_len = frame.map.size;
+	/* scanned on first use, shared by all the parsers */
+	start_code_index_init(&frame.codes, frame.data, frame.data_len);
+	if (self->trick_mode && !gst_dvbvideosink_trick_frame(self, buffer, &frame.codes)) goto ok;
+	if (self->live_latency && gst_dvbvideosink_live_drop(self, buffer, &frame.codes)) goto ok;
+	frame.pes_header = self->pesheader.map.data;
+	frame.pes_header_len = 0;
+	frame.codec_data = NULL;
+	frame.codec_data_size = 0;
+	/* codec_data stays mapped until it gets replaced */
+	mapped_buffer_set(&self->codec_data_map, self->codec_data);
+	if (self->codec_data_map.buffer)
+	{
+		frame.codec_data = self->codec_data_map.map.data;
+		frame.codec_data_size = self->codec_data_map.map.size;
 	}
 
-ok:
-	gst_buffer_unmap(buffer, &map);
-	gst_buffer_unmap(self->pesheader_buffer, &pesheadermap);
-	if (self->codec_data)
+	result = self->render_codec(self, &frame);
+	if (result < 0) goto error;
+
+	if (result == FRAME_WRITTEN && (GST_BUFFER_PTS_IS_VALID(buffer) || (self->use_dts && GST_BUFFER_DTS_IS_VALID(buffer))))
 	{
-		gst_buffer_unmap(self->codec_data, &codecdatamap);
+		GstClockTime end = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+		self->pts_written = TRUE;
+		self->written_pts = (gint64)end - self->timestamp_offset;
+		if (GST_BUFFER_DURATION_IS_VALID(buffer)) end += GST_BUFFER_DURATION(buffer);
+		self->written_position = (gint64)end - self->timestamp_offset;
 	}
-	if (tmpbuf)
+
+ok:
+	start_code_index_free(&frame.codes);
+	pes_packet_free(&frame.packet);
+	gst_buffer_unmap(frame.buffer, &frame.map);
+	if (frame.tmpbuf)
 	{
-		gst_buffer_unref(tmpbuf);
-		tmpbuf = NULL;
+		gst_buffer_unref(frame.tmpbuf);
+		frame.tmpbuf = NULL;
 	}
 
 	return GST_FLOW_OK;
 error:
-	gst_buffer_unmap(buffer, &map);
-	gst_buffer_unmap(self->pesheader_buffer, &pesheadermap);
-	if (self->codec_data)
-	{
-		gst_buffer_unmap(self->codec_data, &codecdatamap);
-	}
+	start_code_index_free(&frame.codes);
+	pes_packet_free(&frame.packet);
+	gst_buffer_unmap(frame.buffer, &frame.map);
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 	if (self->prev_frame && self->prev_frame != buffer)
 	{
@@ -1223,16 +1936,16 @@ error:
 		self->prev_frame = NULL;
 	}
 #endif
-	if (tmpbuf)
+	if (frame.tmpbuf)
 	{
-		gst_buffer_unref(tmpbuf);
-		tmpbuf = NULL;
+		gst_buffer_unref(frame.tmpbuf);
+		frame.tmpbuf = NULL;
 	}
 	{
 		GST_ELEMENT_ERROR(self, RESOURCE, READ, (NULL),
 				("video write: %s", g_strerror (errno)));
 		GST_WARNING_OBJECT (self, "Video write error");
-		return ret == GST_FLOW_OK ? GST_FLOW_ERROR : ret;
+		return frame.ret == GST_FLOW_OK ? GST_FLOW_ERROR : frame.ret;
 	}
 }
 
@@ -1241,16 +1954,16 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK (basesink);
 	GstStructure *structure = gst_caps_get_structure (caps, 0);
 	const char *mimetype = gst_structure_get_name (structure);
+	const GValue *caps_codec_data = gst_structure_get_value(structure, "codec_data");
+	t_stream_type prev_stream_type = self->stream_type;
+	/* kept until we know whether the decoder setup changed */
+	GstBuffer *prev_codec_data = self->codec_data;
 	self->stream_type = STREAMTYPE_UNKNOWN;
 	self->must_send_header = TRUE;
 
 	GST_INFO_OBJECT (self, "caps = %" GST_PTR_FORMAT, caps);
 
-	if (self->codec_data)
-	{
-		gst_buffer_unref(self->codec_data);
-		self->codec_data = NULL;
-	}
+	self->codec_data = NULL;
 
 	GST_DEBUG_OBJECT(self, "set_caps %" GST_PTR_FORMAT, caps);
 
@@ -1495,6 +2208,7 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 			case 5:
 				self->use_dts = TRUE;
 				self->stream_type = STREAMTYPE_DIVX5;
+				self->codec_type = CT_MPEG4_PART2;
 				GST_INFO_OBJECT (self, "MIMETYPE video/x-divx vers. %d -> STREAMTYPE_DIVX5", divxversion);
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 				self->must_pack_bitstream = TRUE;
@@ -1532,7 +2246,7 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		gint numerator, denominator;
 		if (gst_structure_get_fraction (structure, "framerate", &numerator, &denominator))
 		{
-			FILE *f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
+			FILE *f = gst_dvbvideosink_open_framerate(self, "w");
 			if (f)
 			{
 				int valid_framerates[] = { 23976, 24000, 25000, 29970, 30000, 50000, 59940, 60000 };
@@ -1553,6 +2267,18 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 				fclose(f);
 			}
 		}
+		if (self->fast_zap && self->playing && self->fd >= 0 && self->stream_type == prev_stream_type
+			&& buffer_equal(caps_codec_data ? gst_value_get_buffer(caps_codec_data) : NULL, self->caps_codec_data))
+		{
+			GST_INFO_OBJECT(self, "fast zap, keep streamtype %d", self->stream_type);
+			if (!self->codec_data)
+			{
+				/* the codec_data built from the previous caps is still valid */
+				self->codec_data = prev_codec_data;
+				prev_codec_data = NULL;
+			}
+			goto done;
+		}
 		if (self->playing)
 		{
 			if (self->fd >= 0) ioctl(self->fd, VIDEO_STOP, 0);
@@ -1663,9 +2389,26 @@ static gboolean gst_dvbvideosink_set_caps(GstBaseSink *basesink, GstCaps *caps)
 		GST_ELEMENT_ERROR (self, STREAM, TYPE_NOT_FOUND, (NULL), ("unimplemented stream type %s", mimetype));
 	}
 
+done:
+	gst_dvbvideosink_select_render(self);
+	if (prev_codec_data) gst_buffer_unref(prev_codec_data);
+	/* remember the caps codec_data, to detect unchanged codec setups */
+	if (self->caps_codec_data) gst_buffer_unref(self->caps_codec_data);
+	self->caps_codec_data = caps_codec_data ? gst_buffer_ref(gst_value_get_buffer(caps_codec_data)) : NULL;
 	return TRUE;
 }
 
+/*
+ * The decoder only takes data through write(), there is no dmabuf or mmap'd
+ * ring to hand out. Page aligned buffers are the closest to zero copy.
+ */
+static gboolean gst_dvbvideosink_propose_allocation(GstBaseSink *sink, GstQuery *query)
+{
+	GstDVBVideoSink *self = GST_DVBVIDEOSINK(sink);
+	GST_DEBUG_OBJECT(self, "propose page aligned allocation");
+	return propose_page_allocation(query, POOL_BUFFER_SIZE, 2);
+}
+
 static gboolean gst_dvbvideosink_start(GstBaseSink *basesink)
 {
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK(basesink);
@@ -1682,9 +2425,11 @@ static gboolean gst_dvbvideosink_start(GstBaseSink *basesink)
 	fcntl(self->unlockfd[0], F_SETFL, O_NONBLOCK);
 	fcntl(self->unlockfd[1], F_SETFL, O_NONBLOCK);
 
-	self->pesheader_buffer = gst_buffer_new_and_alloc(2048);
+	mapped_buffer_alloc(&self->pesheader, 2048);
+	/* a new header buffer, the template has to be copied in again */
+	self->pes_template.target = NULL;
 
-	f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "r");
+	f = gst_dvbvideosink_open_framerate(self, "r");
 	if (f)
 	{
 		fgets(self->saved_fallback_framerate, sizeof(self->saved_fallback_framerate), f);
@@ -1692,10 +2437,18 @@ static gboolean gst_dvbvideosink_start(GstBaseSink *basesink)
 		f = NULL;
 	}
 
-	self->fd = open("/dev/dvb/adapter0/video0", O_RDWR | O_NONBLOCK);
+	self->fd = self->dvb_device ? dvb_device_open_path(self->dvb_device, TRUE) : dvb_device_open("video", self->dvb_adapter, self->dvb_decoder, TRUE);
+
+	self->writer_error = 0;
+	if (self->writer_thread && self->fd >= 0 && !pes_ring_start(&self->ring, self->ring_size, "dvbvideosink-writer", gst_dvbvideosink_writer, self))
+	{
+		GST_WARNING_OBJECT(self, "cannot start writer thread, writing from render");
+	}
 
 	self->pts_written = FALSE;
 	self->lastpts = 0;
+	self->written_position = self->written_pts = -1;
+	sink_stats_reset(&self->stats);
 
 	return TRUE;
 error:
@@ -1711,6 +2464,14 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 	GstDVBVideoSink *self = GST_DVBVIDEOSINK(basesink);
 	FILE *f = NULL;
 	GST_INFO_OBJECT(self, "stop");
+	if (self->ring.thread)
+	{
+		/* let the writer drop what is left */
+		self->flushing = TRUE;
+		write(self->unlockfd[1], "\x01", 1);
+		pes_ring_stop(&self->ring);
+		self->flushing = FALSE;
+	}
 	if (self->fd >= 0)
 	{
 		if (self->playing)
@@ -1724,8 +2485,9 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 			ioctl(self->fd, VIDEO_FAST_FORWARD, 0);
 			self->rate = 1.0;
 		}
+		self->trick_mode = FALSE;
 		ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_DEMUX);
-		close(self->fd);
+		dvb_device_close(self->fd);
 		self->fd = -1;
 	}
 
@@ -1735,12 +2497,15 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 		self->codec_data = NULL;
 	}
 
-	if (self->pesheader_buffer)
+	if (self->caps_codec_data)
 	{
-		gst_buffer_unref(self->pesheader_buffer);
-		self->pesheader_buffer = NULL;
+		gst_buffer_unref(self->caps_codec_data);
+		self->caps_codec_data = NULL;
 	}
 
+	mapped_buffer_release(&self->codec_data_map);
+	mapped_buffer_release(&self->pesheader);
+
 #ifdef PACK_UNPACKED_XVID_DIVX5_BITSTREAM
 	if (self->prev_frame)
 	{
@@ -1749,12 +2514,10 @@ static gboolean gst_dvbvideosink_stop(GstBaseSink *basesink)
 	}
 #endif
 
-	while (self->queue)
-	{
-		queue_pop(&self->queue);
-	}
+	queue_clear(&self->queue);
+	gst_dvbclock_reset(GST_DVBCLOCK(self->clock));
 
-	f = fopen("/proc/stb/vmpeg/0/fallback_framerate", "w");
+	f = gst_dvbvideosink_open_framerate(self, "w");
 	if (f)
 	{
 		fputs(self->saved_fallback_framerate, f);
@@ -1796,8 +2559,10 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 			ioctl(self->fd, VIDEO_SELECT_SOURCE, VIDEO_SOURCE_MEMORY);
 			ioctl(self->fd, VIDEO_FREEZE);
 		}
-		if(get_downmix_ready())
+		if(get_downmix_ready(element))
 			self->using_dts_downmix = TRUE;
+		if (self->provide_clock)
+			gst_element_post_message(element, gst_message_new_clock_provide(GST_OBJECT_CAST(element), self->clock, TRUE));
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
 		GST_INFO_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_PLAYING");
@@ -1821,6 +2586,8 @@ static GstStateChangeReturn gst_dvbvideosink_change_state(GstElement *element, G
 		break;
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
 		GST_INFO_OBJECT (self,"GST_STATE_CHANGE_PAUSED_TO_READY");
+		if (self->provide_clock)
+			gst_element_post_message(element, gst_message_new_clock_lost(GST_OBJECT_CAST(element), self->clock));
 		break;
 	case GST_STATE_CHANGE_READY_TO_NULL:
 		GST_INFO_OBJECT (self,"GST_STATE_CHANGE_READY_TO_NULL");
@@ -64,6 +64,7 @@ G_BEGIN_DECLS
 typedef struct _GstDVBVideoSink		GstDVBVideoSink;
 typedef struct _GstDVBVideoSinkClass	GstDVBVideoSinkClass;
 typedef struct _GstDVBVideoSinkPrivate	GstDVBVideoSinkPrivate;
+struct video_frame;
 
 typedef enum { CT_MPEG1, CT_MPEG2, CT_H264, CT_DIVX311, CT_DIVX4, CT_MPEG4_PART2, CT_VC1, CT_VC1_SM } t_codec_type;
 #if defined(VUPLUS) || defined(DREAMBOX)
@@ -102,15 +103,27 @@ struct _GstDVBVideoSink
 {
 	GstBaseSink element;
 
+	guint dvb_adapter;
+	guint dvb_decoder;
+	/* device node overriding dvb_adapter and dvb_decoder */
+	gchar *dvb_device;
 	int fd;
 	int unlockfd[2];
 
 	gint h264_nal_len_size;
 
-	GstBuffer *pesheader_buffer;
+	mapped_buffer_t pesheader;
 
 	GstBuffer *codec_data;
+	mapped_buffer_t codec_data_map;
+	GstBuffer *caps_codec_data;
+	/* code of the start code following the parsed mpeg sequence header */
+	guint8 sheader_end_code;
+	guint64 sheader_reparses;
 	t_codec_type codec_type;
+	/* frame handler of the codec, selected in set_caps */
+	int (*render_codec)(GstDVBVideoSink *self, struct video_frame *frame);
+	pes_template_t pes_template;
 	t_stream_type stream_type;
 #if GST_VERSION_MAJOR >= 1
 	gboolean use_dts;
@@ -133,8 +146,37 @@ struct _GstDVBVideoSink
 	gint64 timestamp_offset;
 	gboolean must_send_header;
 	gint8 ok_to_write;
-
-	queue_entry_t *queue;
+	guint resume_timeout;
+	gboolean fast_zap;
+
+	gboolean writer_thread;
+	guint ring_size;
+	pes_ring_t ring;
+	gint writer_error;
+
+	GstClock *clock;
+	gboolean provide_clock;
+
+	/* trick mode: key frames only, paced by the sink */
+	gdouble trick_threshold;
+	gboolean trick_reverse;
+	gboolean trick_mode;
+	GstClockTime trick_prev_pts, trick_out_pts;
+	gint64 trick_time;
+	gint64 trick_position;
+	guint64 trick_dropped;
+
+	write_queue_t queue;
+	sink_stats_t stats;
+
+	/* backpressure: end of the last timestamped data written, in stream time */
+	guint buffer_depth, depth_interval;
+	gint64 written_position, written_pts;
+	gint64 depth_reported;
+	/* live mode, drop instead of letting the latency grow */
+	guint live_latency;
+	guint64 live_dropped;
+	gboolean fast_eos;
 };
 
 struct _GstDVBVideoSinkClass 
@@ -0,0 +1,191 @@
+/*
+ * GStreamer DVB Media Sink
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * pesbench: measures the cost of building a PES header per packet, byte by
+ * byte, against copying the per stream template of common.c.
+ *
+ * build_header is a reference builder written for this benchmark, after the
+ * layout the sinks used to build, not the old sink code itself. It covers the
+ * start code, flags, pts, the 32 bit length field of wma/raw pcm and a fixed
+ * suffix of stream specific bytes. The per packet patches the audio sink runs
+ * behind the template (adts frame size, amr length, lpcm stream id) and the
+ * codec header functions of the sinks are not covered.
+ */
+
+#include <stdio.h>
+#include <gst/gst.h>
+
+#include "common.h"
+
+typedef struct header_case
+{
+	const gchar *name;
+	/* stream specific bytes behind the pts */
+	gsize suffix;
+	/* 32 bit payload length in front of them */
+	gboolean length_field;
+} header_case_t;
+
+static const header_case_t cases[] =
+{
+	{ "video", 0, FALSE },
+	{ "adts", 7, FALSE },
+	{ "wma", 18, TRUE },
+};
+
+/* keeps the compiler from dropping the headers */
+static volatile guint8 header_sink;
+
+static gsize build_header(const header_case_t *header, const guint8 *suffix, guint8 *pes_header, GstClockTime pts, gsize size)
+{
+	gsize len = 9;
+	pes_header[0] = 0;
+	pes_header[1] = 0;
+	pes_header[2] = 1;
+	pes_header[3] = 0xc0;
+	pes_header[6] = 0x81;
+	pes_header[7] = 0; /* no pts */
+	pes_header[8] = 0;
+	if (pts != GST_CLOCK_TIME_NONE)
+	{
+		pes_header[7] = 0x80; /* pts */
+		pes_header[8] = 5; /* pts size */
+		len += 5;
+		pes_set_pts(pts, pes_header);
+	}
+	if (header->length_field)
+	{
+		pes_header[len++] = (size >> 24) & 0xff;
+		pes_header[len++] = (size >> 16) & 0xff;
+		pes_header[len++] = (size >> 8) & 0xff;
+		pes_header[len++] = size & 0xff;
+	}
+	memcpy(pes_header + len, suffix, header->suffix);
+	len += header->suffix;
+	pes_set_payload_size(size + len - 6, pes_header);
+	return len;
+}
+
+static gsize apply_template(pes_template_t *template, guint8 *pes_header, GstClockTime pts, gsize size)
+{
+	gsize len = pes_template_apply(template, pes_header, pts, size);
+	pes_set_payload_size(size + len - 6, pes_header);
+	return len;
+}
+
+/* every 8th packet without pts, like frames a parser could not timestamp */
+#define BENCH_PTS(i) ((i) & 7 ? (GstClockTime)(i) * 40 * GST_MSECOND : GST_CLOCK_TIME_NONE)
+#define BENCH_SIZE(i) (1000 + ((i) & 1023))
+
+static gboolean bench_run(const header_case_t *header, gint iterations)
+{
+	guint8 suffix[PES_TEMPLATE_MAX], built[PES_TEMPLATE_MAX], copied[PES_TEMPLATE_MAX];
+	pes_template_t template;
+	gint64 start, build_us, template_us;
+	gint i;
+
+	for (i = 0; i < header->suffix; i++) suffix[i] = i * 7;
+	pes_template_init(&template, 0xc0);
+	if (header->length_field) pes_template_append_length(&template, 0);
+	pes_template_append(&template, suffix, header->suffix);
+
+	/* both have to give the same bytes before their speed matters */
+	for (i = 0; i < 16; i++)
+	{
+		gsize len = build_header(header, suffix, built, BENCH_PTS(i), BENCH_SIZE(i));
+		if (apply_template(&template, copied, BENCH_PTS(i), BENCH_SIZE(i)) != len || memcmp(built, copied, len))
+		{
+			fprintf(stderr, "%s: template header differs\n", header->name);
+			return FALSE;
+		}
+	}
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < iterations; i++)
+	{
+		gsize len = build_header(header, suffix, built, BENCH_PTS(i), BENCH_SIZE(i));
+		header_sink ^= built[len - 1];
+	}
+	build_us = g_get_monotonic_time() - start;
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < iterations; i++)
+	{
+		gsize len = apply_template(&template, copied, BENCH_PTS(i), BENCH_SIZE(i));
+		header_sink ^= copied[len - 1];
+	}
+	template_us = g_get_monotonic_time() - start;
+
+	printf("%-8s %12.1f %12.1f\n", header->name, build_us * 1000.0 / iterations, template_us * 1000.0 / iterations);
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	gint iterations = 10000000;
+	GOptionEntry entries[] =
+	{
+		{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of headers built per case", "N" },
+		{ NULL }
+	};
+	GOptionContext *context;
+	GError *error = NULL;
+	gboolean ok = TRUE;
+	guint i;
+
+	context = g_option_context_new("- benchmark the PES header build");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error) || iterations < 1)
+	{
+		fprintf(stderr, "%s\n", error ? error->message : "usage: pesbench [-n N]");
+		return 1;
+	}
+	g_option_context_free(context);
+
+	printf("%-8s %12s %12s\n", "header", "build ns", "template ns");
+	for (i = 0; i < G_N_ELEMENTS(cases); i++)
+	{
+		if (!bench_run(&cases[i], iterations)) ok = FALSE;
+	}
+	return ok ? 0 : 1;
+}